@@ -7,73 +7,534 @@
 #include <algorithm>
 #include <cassert>
 #include <unordered_map>
+#include <map>
 #include <optional>
-#include <functional>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
+#include <tuple>
+#include <new>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <iterator>
+#include <limits>
+#include <atomic>
+#include <array>
+#include <deque>
+#include <mutex>
 
 #define assertm(msg, expr) assert(((void)(msg), (expr)))
 
 namespace ecs {
 
 using ComponentID = uint32_t;
-using Entity = uint32_t;
+
+// The low 32 bits of an entity index its slot, the high 32 bits are the
+// version of that slot, bumped each time the slot is freed. A handle kept
+// past its entity's destruction doesn't match whatever reuses the slot, so
+// commands, lookups and targeted events addressed to it find nothing.
+using Entity = uint64_t;
+inline constexpr Entity EntityIndexMask = 0xffffffff;
+using EntitySet = sparse_set<Entity, 1024, EntityIndexMask>;
+
+inline uint32_t EntityIndex(Entity entity) { return uint32_t(entity & EntityIndexMask); }
+inline uint32_t EntityVersion(Entity entity) { return uint32_t(entity >> 32); }
 
 struct Resource{};
 struct Component{};
+struct Event{};
+
+// Dense IDs per category, handed out on first use. Safe to call from any
+// thread, so Worlds on different threads can register types concurrently.
+template <typename Category>
+class IndexGetter final {
+public:
+    template <typename T>
+    static uint32_t Get() {
+        static uint32_t id = curIdx_.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+
+private:
+    inline static std::atomic<uint32_t> curIdx_ = 0;
+
+};
+
+// Non-owning view of contiguous elements.
+template <typename T>
+class Span final {
+public:
+    Span() = default;
+    Span(T* data, size_t size) : data_ { data }, size_ { size } {}
+
+    template <typename Container, typename = std::enable_if_t<std::is_convertible_v<decltype(std::declval<Container&>().data()), T*>>>
+    Span(Container& container) : data_ { container.data() }, size_ { container.size() } {}
+
+    T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    T* begin() const { return data_; }
+    T* end() const { return data_ + size_; }
+
+    T& operator[](size_t index) const { return data_[index]; }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+
+};
+
+inline constexpr uint32_t NullReader = std::numeric_limits<uint32_t>::max();
+
+// An event addressed to one entity. Queues of targeted events bucket each
+// generation by target when it is published, so EventReader::For finds the
+// events of an entity in O(1) instead of every reader filtering them all.
+template <typename T>
+struct Targeted {
+    Entity target;
+    T event;
+};
+
+template <typename T>
+struct IsTargeted : std::false_type {};
+
+template <typename T>
+struct IsTargeted<Targeted<T>> : std::true_type {};
+
+// Hierarchical timing wheel keyed by tick. Level k has 64 slots, each for
+// one 64^k-tick block; an entry sits at the lowest level whose window
+// reaches its due tick, and drops a level whenever its block comes up.
+// Entries beyond the top level wait in overflow buckets, one per top-level
+// block, and each bucket enters the wheel once its block comes in range.
+// An entry moves at most Levels + 1 times, so scheduling and firing are
+// O(1) amortized within 64^Levels ticks, plus a map lookup for farther ones.
+template <typename T>
+class TimerWheel final {
+public:
+    TimerWheel(uint64_t now) : now_ { now } {}
+
+    // `due` must not be before the next tick to process.
+    void Schedule(uint64_t due, T value) {
+        place(Entry{ due, std::move(value) });
+    }
+
+    // Processes the next tick and passes each value due on it to `func`.
+    template <typename Func>
+    void Advance(Func&& func) {
+        auto tick = now_;
+        for (size_t level = Levels - 1; level > 0; level--) {
+            if ((tick & ((uint64_t(1) << (SlotBits * level)) - 1)) != 0) {
+                continue;
+            }
+            if (level == Levels - 1) {
+                drainOverflow();
+            }
+            cascade(slots_[level][(tick >> (SlotBits * level)) & SlotMask]);
+        }
+        auto& slot = slots_[0][tick & SlotMask];
+        for (auto& entry : slot) {
+            func(std::move(entry.value));
+        }
+        slot.clear();
+        now_++;
+    }
+
+private:
+    static constexpr size_t Levels = 4;
+    static constexpr size_t SlotBits = 6;
+    static constexpr uint64_t SlotMask = (1 << SlotBits) - 1;
+
+    struct Entry {
+        uint64_t due;
+        T value;
+    };
+
+    std::array<std::array<std::vector<Entry>, SlotMask + 1>, Levels> slots_;
+    // Keyed by the top-level block of the due tick.
+    std::map<uint64_t, std::vector<Entry>> overflow_;
+    std::vector<Entry> pending_;
+    uint64_t now_;
+
+    void place(Entry&& entry) {
+        for (size_t level = 0; level < Levels; level++) {
+            auto shift = SlotBits * level;
+            if ((entry.due >> shift) - (now_ >> shift) <= SlotMask) {
+                slots_[level][(entry.due >> shift) & SlotMask].push_back(std::move(entry));
+                return;
+            }
+        }
+        overflow_[entry.due >> (SlotBits * (Levels - 1))].push_back(std::move(entry));
+    }
+
+    void drainOverflow() {
+        auto top = now_ >> (SlotBits * (Levels - 1));
+        while (!overflow_.empty() && overflow_.begin()->first - top <= SlotMask) {
+            cascade(overflow_.begin()->second);
+            overflow_.erase(overflow_.begin());
+        }
+    }
+
+    void cascade(std::vector<Entry>& entries) {
+        std::swap(pending_, entries);
+        for (auto& entry : pending_) {
+            place(std::move(entry));
+        }
+        pending_.clear();
+    }
+};
 
+// All events of one type in one World, numbered by a running sequence.
+// Writes go straight into the back queue and are published when events are
+// flushed at the end of a frame. Published events stay readable for two flushes:
+// `older` holds the previous generation, `newer` the latest one. Readers
+// keep a cursor into the sequence, so each of them sees each event once.
+//
+// Registered readers hold the older generation alive until they have read
+// it; once all of them have, it is dropped at the next flush. Events a
+// reader didn't get to within two flushes are counted as missed for it.
+// The three vectors rotate and keep their capacity, so they settle at the
+// high-water mark.
 template <typename T>
-class EventStaging final {
+class EventQueue final {
 public:
-    static void Set(const T& t) {
-        event_ = t;
+    EventQueue(uint64_t now) : now_ { now } {}
+
+    class Iterator final {
+    public:
+        Iterator(EventQueue& queue, uint64_t seq) : queue_ { &queue }, seq_ { seq } {}
+
+        const T& operator*() const { return queue_->At(seq_); }
+        const T* operator->() const { return &queue_->At(seq_); }
+        Iterator& operator++() { ++seq_; return *this; }
+        bool operator==(const Iterator& o) const { return seq_ == o.seq_; }
+        bool operator!=(const Iterator& o) const { return seq_ != o.seq_; }
+
+    private:
+        EventQueue* queue_;
+        uint64_t seq_;
+    };
+
+    std::vector<T>& Back() {
+        return back_;
+    }
+
+    // Readies `count` more worker lanes and returns the index of the first.
+    // Call it before the workers start; each lane is then written by one
+    // thread only. Lanes stay active until the flush, so every system that
+    // forks this queue in a frame gets a range of its own. They are appended
+    // to the back queue in index order, so the event order doesn't depend on
+    // thread timing.
+    size_t Fork(size_t count) {
+        auto first = activeLanes_;
+        activeLanes_ += count;
+        if (lanes_.size() < activeLanes_) {
+            lanes_.resize(activeLanes_);
+        }
+        nextLane_.store(first, std::memory_order_relaxed);
+        return first;
+    }
+
+    std::vector<T>& Lane(size_t index) {
+        assertm("worker lane out of range", index < activeLanes_);
+        return lanes_[index].events;
+    }
+
+    size_t AcquireLane() {
+        return nextLane_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    T& At(uint64_t seq) {
+        return seq < newerStart_ ? older_[seq - olderStart_] : newer_[seq - newerStart_];
+    }
+
+    // The published events from `seq` to the end of its generation, which
+    // are contiguous.
+    Span<const T> Run(uint64_t seq) {
+        if (seq < newerStart_) {
+            return Span<const T>(older_.data() + (seq - olderStart_), size_t(newerStart_ - seq));
+        }
+        return Span<const T>(newer_.data() + (seq - newerStart_), size_t(End() - seq));
+    }
+
+    // Sequence of the first readable and of the latest published generation,
+    // and one past the last published event.
+    uint64_t Start() const { return olderStart_; }
+    uint64_t Latest() const { return newerStart_; }
+    uint64_t End() const { return newerStart_ + newer_.size(); }
+
+    // Events of the latest generation addressed to `target`.
+    Span<const T> For(Entity target) {
+        auto slot = target & EntityIndexMask;
+        if (!targets_.contain(slot)) {
+            return {};
+        }
+        auto& bucket = buckets_[targets_.index_of(slot)];
+        auto first = newer_.data() + bucket.first;
+        auto last = first + bucket.count;
+        if (bucket.mixed) {
+            first = std::lower_bound(first, last, target, [](const T& event, Entity target) { return event.target < target; });
+            last = std::upper_bound(first, last, target, [](Entity target, const T& event) { return target < event.target; });
+        }
+        else if (bucket.target != target) {
+            return {};
+        }
+        return Span<const T>(first, size_t(last - first));
     }
 
-    static void Set(T&& t) {
-        event_ = std::move(t);
+    // Replaces the latest generation before anyone has read it. Replay uses
+    // this to publish the recorded events instead of the ones written.
+    void Republish(const T* events, size_t count) {
+        newer_.assign(events, events + count);
+        if constexpr (IsTargeted<T>::value) {
+            bucketByTarget();
+        }
     }
 
-    static T& Get() {
-        return *event_;
+    // Publishes the event at the flush `ticks` frames after the next one.
+    void Delay(uint64_t ticks, T event) {
+        if (!delayed_) {
+            delayed_ = std::make_unique<TimerWheel<T>>(now_);
+        }
+        delayed_->Schedule(now_ + ticks, std::move(event));
     }
 
-    static bool Has() {
-        return event_ != std::nullopt;
+    uint32_t AddReader() {
+        cursors_.push_back(newerStart_);
+        missed_.push_back(0);
+        return uint32_t(cursors_.size() - 1);
     }
 
-    static void Clear() {
-        event_ = std::nullopt;
+    uint64_t& Cursor(uint32_t reader) { return cursors_[reader]; }
+    uint64_t Missed(uint32_t reader) const { return missed_[reader]; }
+
+    void Flush() {
+        if (delayed_) {
+            delayed_->Advance([this](T&& event) { back_.push_back(std::move(event)); });
+        }
+        now_++;
+        for (size_t i = 0; i < activeLanes_; i++) {
+            auto& lane = lanes_[i].events;
+            for (auto& event : lane) {
+                back_.push_back(std::move(event));
+            }
+            lane.clear();
+        }
+        activeLanes_ = 0;
+        for (size_t i = 0; i < cursors_.size(); i++) {
+            if (cursors_[i] < newerStart_) {
+                missed_[i] += newerStart_ - cursors_[i];
+                cursors_[i] = newerStart_;
+            }
+        }
+        older_.clear();
+        std::swap(older_, newer_);
+        std::swap(newer_, back_);
+        olderStart_ = newerStart_;
+        newerStart_ += older_.size();
+        if constexpr (IsTargeted<T>::value) {
+            bucketByTarget();
+        }
+        if (std::all_of(cursors_.begin(), cursors_.end(), [this](uint64_t cursor) { return cursor >= newerStart_; })) {
+            older_.clear();
+            olderStart_ = newerStart_;
+        }
     }
 
 private:
-    inline static std::optional<T> event_ = std::nullopt;
-    
+    std::vector<T> older_;
+    std::vector<T> newer_;
+    std::vector<T> back_;
+    uint64_t olderStart_ = 0;
+    uint64_t newerStart_ = 0;
+    std::vector<uint64_t> cursors_;
+    std::vector<uint64_t> missed_;
+
+    // Own cache line each, so writers on different cores don't contend. A
+    // deque, so forking more lanes doesn't move the ones being written.
+    struct alignas(64) WorkerLane {
+        std::vector<T> events;
+    };
+
+    std::deque<WorkerLane> lanes_;
+    size_t activeLanes_ = 0;
+    std::atomic<size_t> nextLane_ = 0;
+
+    // Flushes so far, and the wheel holding delayed events, made on first use.
+    uint64_t now_;
+    std::unique_ptr<TimerWheel<T>> delayed_;
+
+    // Targeted queues only: the latest generation's range for each entity
+    // slot. A slot's events normally share one target; if they are for
+    // several versions of it, the range is sorted by target.
+    struct Bucket {
+        size_t first;
+        size_t count;
+        Entity target;
+        bool mixed;
+    };
+
+    EntitySet targets_;
+    std::vector<Bucket> buckets_;
+    std::vector<uint32_t> order_;
+
+    // Counting sort of the freshly published generation by entity slot,
+    // stable within a target: O(events), no comparisons unless a slot has
+    // events for several versions. No reader has seen the generation yet,
+    // so reordering it doesn't disturb any cursor.
+    void bucketByTarget() {
+        targets_.reset();
+        buckets_.clear();
+        for (auto& event : newer_) {
+            auto slot = event.target & EntityIndexMask;
+            if (!targets_.contain(slot)) {
+                targets_.add(slot);
+                buckets_.push_back({ 0, 0, event.target, false });
+            }
+            auto& bucket = buckets_[targets_.index_of(slot)];
+            bucket.count++;
+            bucket.mixed |= bucket.target != event.target;
+        }
+        size_t first = 0;
+        for (auto& bucket : buckets_) {
+            bucket.first = first;
+            first += bucket.count;
+            bucket.count = 0;
+        }
+        order_.resize(newer_.size());
+        for (size_t i = 0; i < newer_.size(); i++) {
+            auto& bucket = buckets_[targets_.index_of(newer_[i].target & EntityIndexMask)];
+            order_[bucket.first + bucket.count++] = uint32_t(i);
+        }
+        for (auto& bucket : buckets_) {
+            if (bucket.mixed) {
+                std::sort(order_.begin() + bucket.first, order_.begin() + bucket.first + bucket.count, [this](uint32_t a, uint32_t b) {
+                    return newer_[a].target != newer_[b].target ? newer_[a].target < newer_[b].target : a < b;
+                });
+            }
+        }
+        back_.clear();
+        for (auto index : order_) {
+            back_.push_back(std::move(newer_[index]));
+        }
+        std::swap(newer_, back_);
+        back_.clear();
+    }
+
 };
 
+// Reads the events published since this reader last read. A reader taken
+// as a system param keeps its cursor in the system's context between runs;
+// one made with Events::Reader starts at the latest published generation.
+// If it is kept across frames and falls behind, the dropped events are
+// skipped and counted in Missed.
 template <typename T>
 class EventReader final {
 public:
+    EventReader(EventQueue<T>& queue, uint32_t reader = NullReader)
+        : queue_ { queue }, reader_ { reader }, cursor_ { queue.Latest() } {}
+
     bool Has() {
-        return EventStaging<T>::Has();
+        return cursor() < queue_.End();
+    }
+
+    // Consumes the oldest unread event. The reference stays valid until the
+    // next flush, and no reader copies the event.
+    const T& Read() {
+        assertm("no unread event", Has());
+        return queue_.At(cursor()++);
+    }
+
+    // Consumes the unread events of the oldest generation that has any, as
+    // one contiguous span. A reader that fell a frame behind gets the rest
+    // from a second call; an empty span means everything has been read.
+    Span<const T> ReadAll() {
+        auto events = queue_.Run(cursor());
+        cursor() += events.size();
+        return events;
     }
 
-    T Read() {
-        return EventStaging<T>::Get();
+    // Iterating consumes every unread event.
+    auto begin() {
+        auto first = cursor();
+        cursor() = queue_.End();
+        return typename EventQueue<T>::Iterator(queue_, first);
+    }
+    auto end() { return typename EventQueue<T>::Iterator(queue_, queue_.End()); }
+
+    // Targeted events only: the latest generation's events addressed to
+    // `target`, as a contiguous span. Doesn't move the cursor, so a system
+    // can look up each of its entities.
+    auto For(Entity target) {
+        static_assert(IsTargeted<T>::value, "For needs an EventReader<Targeted<T>>");
+        return queue_.For(target);
     }
 
+    // Skips the unread events of this reader only.
     void Clear() {
-        EventStaging<T>::Clear();
+        cursor() = queue_.End();
+    }
+
+    // Published events this reader hasn't consumed yet.
+    size_t Lag() {
+        return size_t(queue_.End() - cursor());
     }
+
+    // Events dropped before this reader consumed them.
+    uint64_t Missed() {
+        if (reader_ != NullReader) {
+            return queue_.Missed(reader_);
+        }
+        cursor();
+        return missed_;
+    }
+
+private:
+    EventQueue<T>& queue_;
+    uint32_t reader_;
+    uint64_t cursor_;
+    uint64_t missed_ = 0;
+
+    // Registered cursors are moved past dropped events at flush; this
+    // reader's own cursor is caught up here.
+    uint64_t& cursor() {
+        if (reader_ != NullReader) {
+            return queue_.Cursor(reader_);
+        }
+        if (cursor_ < queue_.Start()) {
+            missed_ += queue_.Start() - cursor_;
+            cursor_ = queue_.Start();
+        }
+        return cursor_;
+    }
+
 };
 
 template <typename T>
 class EventWriter;
 class World;
+class ReplaySchema;
 
+// Owns the event queues of one World, indexed by the dense event type ID.
 class Events final {
 public:
     friend class World; 
-
-    template <typename T>
-    friend class EventWriter;
+    friend class ReplaySchema;
+
+    template <typename Param>
+    friend struct SystemParam;
+
+    Events() = default;
+    Events(const Events&) = delete;
+    Events& operator= (const Events&) = delete;
+    ~Events() {
+        for (auto& info : queues_) {
+            if (info.queue) {
+                info.destroy(info.queue);
+            }
+        }
+    }
 
     template <typename T>
     auto Reader();
@@ -82,451 +543,3143 @@ public:
     auto Writer();
 
 private:
-    std::vector<void(*)(void)> removeEventFuncs_;
-    std::vector<void(*)(void)> removeOldEventFuncs_;
-    std::vector<std::function<void(void)>> addEventFuncs_;
+    struct QueueInfo {
+        void* queue = nullptr;
+        void (*flush)(void*) = nullptr;
+        void (*destroy)(void*) = nullptr;
+    };
+
+    std::vector<QueueInfo> queues_;
+    uint64_t flushes_ = 0;
 
-    void addAllEvents() {
-        for (auto func : addEventFuncs_) {
-            func();
+    template <typename T>
+    EventQueue<T>& assureQueue() {
+        auto index = IndexGetter<Event>::Get<T>();
+        if (index >= queues_.size()) {
+            queues_.resize(index + 1);
+        }
+        auto& info = queues_[index];
+        if (!info.queue) {
+            info.queue = new EventQueue<T>(flushes_);
+            info.flush = [](void* queue) { ((EventQueue<T>*)queue)->Flush(); };
+            info.destroy = [](void* queue) { delete (EventQueue<T>*)queue; };
         }
-        addEventFuncs_.clear();
+        return *(EventQueue<T>*)info.queue;
     }
 
-    void removeOldEvents() {
-        for (auto func : removeOldEventFuncs_) {
-            func();
+    void flushEvents() {
+        for (auto& info : queues_) {
+            if (info.queue) {
+                info.flush(info.queue);
+            }
         }
-        removeOldEventFuncs_ = removeEventFuncs_;
-        removeEventFuncs_.clear();
+        flushes_++;
     }
 
 };
 
+// Appends to the queue's back buffer, or to a worker lane; nothing is
+// allocated once the buffer has grown to the frame's high-water mark.
 template <typename T>
 class EventWriter final {
 public:
-    EventWriter(Events& e) : events_ { e } {}
-    void Write(const T& t); 
+    EventWriter(EventQueue<T>& queue) : queue_ { queue }, buffer_ { &queue.Back() } {}
+
+    void Write(const T& t) {
+        buffer_->push_back(t);
+    }
+
+    void Write(T&& t) {
+        buffer_->push_back(std::move(t));
+    }
+
+    template <typename... Args>
+    void Emplace(Args&&... args) {
+        buffer_->emplace_back(std::forward<Args>(args)...);
+    }
+
+    // Readers see the event `ticks` frames later than with Write;
+    // WriteAfter(0, t) is Write(t). Not available on worker lanes.
+    void WriteAfter(uint64_t ticks, T t) {
+        assertm("delayed events can't be written from a worker lane", buffer_ == &queue_.Back());
+        queue_.Delay(ticks, std::move(t));
+    }
+
+    // Same contract as Commands::Fork: fork on one thread, then hand
+    // Worker(i) to the i-th worker. Lane events follow everything written
+    // to the queue itself this frame, and the lanes forked before them.
+    EventWriter& Fork(size_t count) {
+        firstLane_ = queue_.Fork(count);
+        lanes_ = count;
+        return *this;
+    }
+
+    EventWriter Worker(size_t index) {
+        assertm("worker index out of range", index < lanes_);
+        return EventWriter(queue_, queue_.Lane(firstLane_ + index));
+    }
+
+    // For pools whose threads have no index: each call takes the next free
+    // lane. Events then follow the order lanes were taken in, which isn't
+    // deterministic.
+    EventWriter AcquireWorker() {
+        auto lane = queue_.AcquireLane();
+        assertm("more workers than forked lanes", lane < firstLane_ + lanes_);
+        return EventWriter(queue_, queue_.Lane(lane));
+    }
 
 private:
-    Events& events_;
+    EventQueue<T>& queue_;
+    std::vector<T>* buffer_;
+    size_t firstLane_ = 0;
+    size_t lanes_ = 0;
+
+    EventWriter(EventQueue<T>& queue, std::vector<T>& buffer) : queue_ { queue }, buffer_ { &buffer } {}
 
 };
 
 template <typename T>
 auto Events::Reader() {
-    return EventReader<T>{};
+    return EventReader<T>(assureQueue<T>());
 }
 
 template <typename T>
 auto Events::Writer() {
-    return EventWriter<T>(*this);
-}
-
-template <typename T>
-void EventWriter<T>::Write(const T& t) {
-    events_.addEventFuncs_.push_back([=](){
-        EventStaging<T>::Set(t);
-    });
-    events_.removeEventFuncs_.push_back([](){
-        EventStaging<T>::Clear();
-    });
+    return EventWriter<T>(assureQueue<T>());
 }
 
-template <typename Category>
-class IndexGetter final {
+inline constexpr Entity NullEntity = std::numeric_limits<Entity>::max();
+
+// Entity IDs of one world. Acquire and Reserve are lock-free and may be
+// called from any thread. Release and Recycle must only be called at sync
+// points, when nothing acquires: the free list is only popped concurrently,
+// never pushed, so a plain CAS on its length is enough.
+//
+// IDs released during a frame are handed out again only after the next
+// Recycle, and with the next version of their slot, so a stale handle
+// never refers to the entity that reuses it.
+//
+// Batches take consecutive fresh IDs and never draw from the free list, so
+// it is capped at MaxFree; IDs released beyond that are simply not reused.
+// Fresh IDs count from 0 in every World, so a replay gets the recorded IDs.
+class EntityAllocator final {
 public:
-    template <typename T>
-    static uint32_t Get() {
-        static uint32_t id = curIdx_++;
-        return id;
+    static constexpr size_t MaxFree = size_t(1) << 16;
+
+    EntityAllocator() = default;
+    EntityAllocator(const EntityAllocator&) = delete;
+    EntityAllocator& operator= (const EntityAllocator&) = delete;
+
+    // A recycled ID if one is available, otherwise a fresh one.
+    Entity Acquire() {
+        auto available = available_.load(std::memory_order_acquire);
+        while (available > 0 && !available_.compare_exchange_weak(available, available - 1, std::memory_order_acquire)) {}
+        return available > 0 ? free_[available - 1] : next_.fetch_add(1, std::memory_order_relaxed);
     }
 
-private:
-    inline static uint32_t curIdx_ = 0;
+    // `count` consecutive fresh IDs; returns the first one.
+    Entity Reserve(size_t count) {
+        return next_.fetch_add(Entity(count), std::memory_order_relaxed);
+    }
 
-};
+    // Bumps the version, which wraps after 2^32 reuses of the slot.
+    void Release(Entity entity) {
+        released_.push_back(entity + EntityIndexMask + 1);
+    }
 
-template <typename T, typename = std::enable_if<std::is_integral_v<T>>>
-struct IDGenerator {
-public:
-    static T Generator() {
-        return curId_++;
+    void Recycle() {
+        free_.resize(available_.load(std::memory_order_relaxed));
+        auto keep = std::min(released_.size(), MaxFree - std::min(MaxFree, free_.size()));
+        free_.insert(free_.end(), released_.begin(), released_.begin() + keep);
+        released_.clear();
+        available_.store(free_.size(), std::memory_order_release);
     }
 
 private:
-    inline static T curId_ = {};
-
+    std::vector<Entity> free_;
+    std::vector<Entity> released_;
+    std::atomic<size_t> available_ = 0;
+    std::atomic<Entity> next_ = 0;
 };
 
-using EntityGenerator = IDGenerator<Entity>;
-
 class Commands;
 class Resources;
 class Queryer;
+class Recorder;
+class Replayer;
 
 using UpdateSystem = void(*)(Commands&, Queryer, Resources, Events&);
 using StartupSystem = void(*)(Commands&);
 
-class World final {
-public:
-    friend class Commands;
-    friend class Resources;
-    friend class Queryer;
+// How often a system runs. A system with period N runs every N-th frame; with
+// N slices it sees only 1/N of the entities matched by each query per run, so
+// a full pass over the entities takes N runs.
+struct Schedule {
+    uint32_t period = 1;
+    uint32_t slices = 1;
 
-    using ComponentContainer = std::unordered_map<ComponentID, void*>;
+    static Schedule Every(uint32_t frames) {
+        return Schedule{frames, 1};
+    }
 
-    World() = default;
-    World(const World&) = delete;
-    World& operator= (const World&) = delete;
+    static Schedule Staggered(uint32_t slices) {
+        return Schedule{1, slices};
+    }
 
-    World& AddStartupSystem(StartupSystem system) {
-        startupSystems_.push_back(system);
+    Schedule& Stagger(uint32_t count) {
+        slices = count;
         return *this;
     }
 
-    World& AddSystem(UpdateSystem system) {
-        updateSystems_.push_back(system);
+    // Skipped while a Replayer drives the World: input polling, I/O and
+    // rendering, whose effects on the simulation are in the log.
+    bool liveOnly = false;
+
+    Schedule& LiveOnly() {
+        liveOnly = true;
         return *this;
     }
+};
 
-    void Startup();
-    void Update();
-    void Shutdown() {
-        entities_.clear();
-        resource_.clear();
-        componentMap_.clear();
-    }
+enum class TaskStatus {
+    Yield,
+    Done,
+};
 
-    template <typename T>
-    World& SetResources(T&& resource);
+class Budget final {
+public:
+    using Clock = std::chrono::steady_clock;
 
-private:
-    struct Pool final { 
-        std::vector<void*> instances;
-        std::vector<void*> cache;
+    Budget(Clock::duration limit) : start_ { Clock::now() }, deadline_ { start_ + limit } {}
 
-        using CreateFunc = void*(*)(void);
-        using DestroyFunc = void(*)(void*);
+    bool Expired() const {
+        return Clock::now() >= deadline_;
+    }
 
-        CreateFunc create;
-        DestroyFunc destroy;
+    Clock::duration Elapsed() const {
+        return Clock::now() - start_;
+    }
 
-        Pool(CreateFunc create, DestroyFunc destroy) : create { create }, destroy { destroy } {
-            assertm("You must give a not-null create function", create);
-            assertm("You must give a not-null destroy function", destroy);
-        }
+    Clock::duration Remaining() const {
+        auto now = Clock::now();
+        return now < deadline_ ? deadline_ - now : Clock::duration::zero();
+    }
 
-        void* Create() {
-            if (!cache.empty()) {
-                instances.push_back(cache.back());
-                cache.pop_back();
-            }
-            else {
-                instances.push_back(create());
+private:
+    Clock::time_point start_;
+    Clock::time_point deadline_;
+
+};
+
+// A resumable system keeps its State between frames. The state starts
+// value-initialized. The system should check the budget while working and
+// return Yield to continue next frame, or Done to have its state reset and
+// start over next frame.
+template <typename State>
+using ResumableSystem = TaskStatus(*)(State&, Commands&, Queryer, Resources, Events&, Budget&);
+
+// Type-erased operations on a component type, shared by the command buffer
+// and the component pools.
+struct ComponentVTable {
+    size_t size;
+    size_t align;
+    bool trivial;
+    void (*relocate)(void* dst, void* src);
+    void (*destroy)(void* elem);
+    // Copy constructs `count` elements from one prototype. Null when the
+    // type isn't copy constructible.
+    void (*fill)(void* dst, const void* src, size_t count);
+
+    // Relocates `count` consecutive elements, with one memcpy when possible.
+    void RelocateRange(void* dst, void* src, size_t count) const {
+        if (trivial) {
+            if (count) {
+                std::memcpy(dst, src, count * size);
             }
-            return instances.back();
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            relocate((std::byte*)dst + i * size, (std::byte*)src + i * size);
         }
+    }
 
-        void Destroy(void* elem) {
-            if (auto it = std::find(instances.begin(), instances.end(), elem); it != instances.end()) {
-                cache.push_back(*it);
-                std::swap(*it, instances.back());
-                instances.pop_back();
-            }
-            else {
-                assertm("Element not in pool!", false);
-            }
+    template <typename T>
+    static const ComponentVTable* Of() {
+        static const ComponentVTable vtable {
+            sizeof(T),
+            alignof(T),
+            std::is_trivially_copyable_v<T>,
+            [](void* dst, void* src) {
+                new (dst) T(std::move(*(T*)src));
+                ((T*)src)->~T();
+            },
+            [](void* elem) { ((T*)elem)->~T(); },
+            fillFunc<T>(),
+        };
+        return &vtable;
+    }
+
+private:
+    // Trivial types are filled by doubling memcpys from the first copy.
+    template <typename T>
+    static auto fillFunc() -> decltype(fill) {
+        if constexpr (!std::is_copy_constructible_v<T>) {
+            return nullptr;
         }
-    };
+        else if constexpr (std::is_trivially_copyable_v<T>) {
+            return [](void* dst, const void* src, size_t count) {
+                if (count == 0) {
+                    return;
+                }
+                std::memcpy(dst, src, sizeof(T));
+                for (size_t done = 1; done < count; done *= 2) {
+                    std::memcpy((T*)dst + done, dst, sizeof(T) * std::min(done, count - done));
+                }
+            };
+        }
+        else {
+            return [](void* dst, const void* src, size_t count) {
+                for (size_t i = 0; i < count; i++) {
+                    new ((T*)dst + i) T(*(const T*)src);
+                }
+            };
+        }
+    }
+};
 
-    struct ComponentInfo {
-        Pool pool;
-        sparse_set<Entity, 32> sparseSet;
+// Handle to a prefab registered with World::RegisterPrefab.
+struct Prefab {
+    uint32_t index;
+};
 
-        ComponentInfo(Pool::CreateFunc create, Pool::DestroyFunc destory) : pool{create, destory} {}
-        ComponentInfo() : pool{nullptr, nullptr} {}
-    };
+// What a system touches, derived from its parameter types. Systems whose
+// access sets don't conflict can run at the same time.
+struct Access {
+    std::vector<ComponentID> reads;
+    std::vector<ComponentID> writes;
+    std::vector<uint32_t> resourceReads;
+    std::vector<uint32_t> resourceWrites;
+    std::vector<uint32_t> eventReads;
+    std::vector<uint32_t> eventWrites;
+    bool exclusive = false;
+
+    bool Conflicts(const Access& o) const {
+        return exclusive || o.exclusive ||
+               overlaps(writes, o.reads) || overlaps(writes, o.writes) || overlaps(reads, o.writes) ||
+               overlaps(resourceWrites, o.resourceReads) || overlaps(resourceWrites, o.resourceWrites) || overlaps(resourceReads, o.resourceWrites) ||
+               overlaps(eventWrites, o.eventReads) || overlaps(eventWrites, o.eventWrites) || overlaps(eventReads, o.eventWrites);
+    }
 
-    using ComponentMap = std::unordered_map<ComponentID, ComponentInfo>;
-    ComponentMap componentMap_;
-    std::unordered_map<Entity, ComponentContainer> entities_;
+private:
+    static bool overlaps(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+        return std::any_of(a.begin(), a.end(), [&b](auto id) { return std::find(b.begin(), b.end(), id) != b.end(); });
+    }
+};
 
-    struct ResourceInfo {
-        void* resource = nullptr;
+template <typename Param>
+struct SystemParam;
 
-        using CreateFunc = void*(*)(void);
-        using DestroyFunc = void(*)(void*);
+// Bump allocator for per-run temporaries. Reset() keeps the memory, and if a
+// run spilled into overflow blocks the main buffer grows to the high-water
+// mark, so a system in steady state stops allocating after a few frames.
+class ScratchArena final : public std::pmr::memory_resource {
+public:
+    ScratchArena() = default;
+    ScratchArena(ScratchArena&&) = default;
+    ScratchArena& operator= (ScratchArena&&) = default;
 
-        CreateFunc create = nullptr;
-        DestroyFunc destroy = nullptr;
+    template <typename T>
+    T* Allocate(size_t count = 1) {
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
 
-        ResourceInfo(CreateFunc create, DestroyFunc destroy) : create { create }, destroy { destroy } {
-            assertm("You must give a not-null create function", create);
-            assertm("You must give a not-null destroy function", destroy);
+    void Reset() {
+        highWater_ = std::max(highWater_, used_ + overflowBytes_);
+        if (!overflow_.empty()) {
+            overflow_.clear();
+            capacity_ = std::max(highWater_, capacity_ * 2);
+            buffer_ = std::make_unique<std::byte[]>(capacity_);
         }
-        ResourceInfo() = default;
-        ~ResourceInfo() {
-            destroy(resource);
+        used_ = 0;
+        overflowBytes_ = 0;
+    }
+
+    size_t Capacity() const { return capacity_; }
+    size_t HighWater() const { return highWater_; }
+
+private:
+    std::unique_ptr<std::byte[]> buffer_;
+    std::vector<std::unique_ptr<std::byte[]>> overflow_;
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+    size_t overflowBytes_ = 0;
+    size_t highWater_ = 0;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        auto base = reinterpret_cast<uintptr_t>(buffer_.get());
+        auto aligned = (base + used_ + alignment - 1) & ~(uintptr_t(alignment) - 1);
+        if (buffer_ && aligned + bytes <= base + capacity_) {
+            used_ = aligned - base + bytes;
+            return reinterpret_cast<void*>(aligned);
         }
-    };
+        overflow_.push_back(std::make_unique<std::byte[]>(bytes + alignment));
+        overflowBytes_ += bytes + alignment;
+        auto block = reinterpret_cast<uintptr_t>(overflow_.back().get());
+        return reinterpret_cast<void*>((block + alignment - 1) & ~(uintptr_t(alignment) - 1));
+    }
 
-    std::unordered_map<ComponentID, ResourceInfo> resource_;
-    std::vector<StartupSystem> startupSystems_;
-    std::vector<UpdateSystem> updateSystems_;
-    Events events_;
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
 };
 
-class Commands final {
+// State the World keeps for one system across frames.
+class SystemContext final {
 public:
-    Commands(World& world) : world_ { world } {}
+    friend class World;
 
-    template <typename... ComponentTypes>
-    Commands& Spawn(ComponentTypes&&... components) {
-        Spawn_r<ComponentTypes...>(std::forward<ComponentTypes>(components)...);
-        return *this;
+    template <typename Param>
+    friend struct SystemParam;
+
+    SystemContext(World& world) : world_ { &world } {}
+
+    uint64_t LastRun() const { return lastRun_; }
+    uint64_t ThisRun() const { return thisRun_; }
+    bool FirstRun() const { return firstRun_; }
+
+    ScratchArena& Scratch() { return scratch_; }
+
+    // Like Queryer::Query, but the resolved component sets and the result
+    // vector are kept between runs.
+    template <typename... Components>
+    const std::vector<Entity>& Query();
+
+private:
+    struct QueryPlan {
+        std::vector<ComponentID> ids;
+        std::vector<EntitySet*> sets;
+        std::vector<Entity> entities;
+    };
+
+    World* world_;
+    std::unordered_map<uint32_t, QueryPlan> plans_;
+    // Reader registered with each event queue, by event type.
+    std::vector<uint32_t> eventReaders_;
+    ScratchArena scratch_;
+    uint64_t lastRun_ = 0;
+    uint64_t thisRun_ = 0;
+    bool firstRun_ = true;
+    uint32_t slice_ = 0;
+    uint32_t slices_ = 1;
+
+    void begin(uint64_t tick, uint32_t slice, uint32_t slices) {
+        thisRun_ = tick;
+        slice_ = slice;
+        slices_ = slices;
+        scratch_.Reset();
     }
 
-    template <typename... ComponentTypes>
-    Entity Spawn_r(ComponentTypes&&... components) {
-        EntitySpawnInfo info;
-        info.entity = EntityGenerator::Generator();
-        doSpawn(info.entity, info.components, std::forward<ComponentTypes>(components)...);
-        spawnEntities_.push_back(info);
-        return info.entity;
+    void end() {
+        lastRun_ = thisRun_;
+        firstRun_ = false;
     }
 
-    Commands& Destroy(Entity entity) {
-        destroyEntities.push_back(entity);
+    bool resolve(QueryPlan& plan);
+
+    // Drops the resolved sets, for when the World's storage goes away.
+    void forgetSets() {
+        for (auto& [id, plan] : plans_) {
+            plan.sets.assign(plan.sets.size(), nullptr);
+        }
+    }
+
+    uint32_t& eventReader(uint32_t eventIndex) {
+        if (eventIndex >= eventReaders_.size()) {
+            eventReaders_.resize(eventIndex + 1, NullReader);
+        }
+        return eventReaders_[eventIndex];
+    }
+};
+
+class World final {
+public:
+    friend class Commands;
+    friend class Resources;
+    friend class Queryer;
+    friend class SystemContext;
+    friend class Recorder;
+    friend class Replayer;
+
+    template <typename Param>
+    friend struct SystemParam;
+
+    template <typename... Components>
+    friend class Query;
+
+    World() = default;
+    World(const World&) = delete;
+    World& operator= (const World&) = delete;
+
+    World& AddStartupSystem(StartupSystem system) {
+        startupSystems_.push_back(system);
         return *this;
     }
 
-    template <typename T> 
-    Commands& SetResource(T&& resource) {
-        auto index = IndexGetter<Resource>::Get<T>();
-        if (auto it = world_.resource_.find(index); it != world_.resource_.end()) {
-            assertm("resource already exists", it->second.resource);
-            it->second.resource = new T(std::forward<T>(resource));
+    // Accepts any callable whose parameters are system params: Query<...>,
+    // Res<T>, ResMut<T>, EventReader<T>, EventWriter<T>, Commands&,
+    // SystemContext&, or the untracked Queryer, Resources and Events&. Only
+    // the declared params are built. The callable is stored by value, so it
+    // can keep its own state.
+    template <typename System>
+    World& AddSystem(System&& system, Schedule schedule = {});
+
+    const Access& SystemAccess(size_t index) const {
+        return updateSystems_[index].access;
+    }
+
+    // Command buffer high-water marks of the index-th update system.
+    auto CommandStats(size_t index) const;
+
+    template <typename State>
+    World& AddResumableSystem(ResumableSystem<State> system, Budget::Clock::duration budget);
+
+    void Startup();
+    void Update();
+
+    class Builder;
+
+    uint64_t Tick() const { return tick_; }
+
+    // Entity handles for commands recorded on other threads; see
+    // Commands::SpawnAt. Both are lock-free unless a Recorder is attached.
+    Entity ReserveEntity();
+    Entity ReserveEntities(size_t count);
+
+    // Registers component values that Instantiate copies into every new
+    // instance. Types may be given explicitly or deduced, as for Spawn.
+    template <typename... ComponentTypes, typename... Args>
+    Prefab RegisterPrefab(Args&&... components) {
+        if constexpr (sizeof...(ComponentTypes) == 0) {
+            return RegisterPrefab<std::decay_t<Args>...>(std::forward<Args>(components)...);
         }
         else {
-            auto newIt = world_.resource_.emplace(index, World::ResourceInfo(
-                []()->void* { return new T; },
-                [](void* elem) { delete (T*)(elem); }
-            ));
-            newIt.first->second.resource = new T;
-            *((T*)newIt.first->second.resource) = std::forward<T>(resource);
+            static_assert(sizeof...(ComponentTypes) == sizeof...(Args), "one argument per component type");
+            static_assert((std::is_copy_constructible_v<ComponentTypes> && ...), "prefab components must be copy constructible");
+            auto& info = prefabs_.emplace_back();
+            (info.Add<ComponentTypes>(std::forward<Args>(components)), ...);
+            return Prefab{ uint32_t(prefabs_.size() - 1) };
         }
+    }
+
+    // Component hooks, run when Commands are executed and immediately from a
+    // World::Builder. Each gets the entity and its component, as
+    // func(Entity, T&). OnAdd runs once the whole spawn or insert is in
+    // place, OnReplace after an insert overwrote an existing component, and
+    // OnRemove just before the component is destroyed, including when its
+    // entity is. Hooks must not change the World's structure.
+    template <typename T, typename Func>
+    World& OnAdd(Func&& func) {
+        assureHooks(IndexGetter<Component>::Get<T>()).onAdd.push_back(makeHook<T>(std::forward<Func>(func)));
         return *this;
     }
 
-    template <typename T>
-    Commands& RemoveResource() {
-        auto index = IndexGetter<Resource>::Get<T>();
-        destroyResources_.push_back(ResourceDestroyInfo(index, [](void* elem) { delete (T*)elem; }))
+    template <typename T, typename Func>
+    World& OnRemove(Func&& func) {
+        assureHooks(IndexGetter<Component>::Get<T>()).onRemove.push_back(makeHook<T>(std::forward<Func>(func)));
         return *this;
     }
 
-    void Execute() {
-        for (auto e : destroyEntities) {
-            destroyEntity(e);
-        } 
-        for (auto& info : destroyResources_) {
-            removeResource(info);
-        }
-        for (auto& spawnInfo : spawnEntities_) {
-            auto it = world_.entities_.emplace(spawnInfo.entity, World::ComponentContainer{});
-            for (auto& componentInfo : spawnInfo.components) {
-                it.first->second[componentInfo.index] = doSpawnWithoutType(spawnInfo.entity, componentInfo);
-            }
+    template <typename T, typename Func>
+    World& OnReplace(Func&& func) {
+        assureHooks(IndexGetter<Component>::Get<T>()).onReplace.push_back(makeHook<T>(std::forward<Func>(func)));
+        return *this;
+    }
+
+    void Shutdown() {
+        entities_.clear();
+        resource_.clear();
+        componentMap_.clear();
+        for (auto& info : updateSystems_) {
+            info.context.forgetSets();
         }
     }
 
+    template <typename T>
+    World& SetResources(T&& resource);
+
 private:
-    World& world_;
+    // Components of one type, stored densely in the same order as the
+    // entities in the matching sparse set.
+    struct Pool final {
+        const ComponentVTable* vtable;
+        std::byte* data = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+
+        Pool(const ComponentVTable* vtable) : vtable { vtable } {
+            assertm("You must give a not-null vtable", vtable);
+        }
+        Pool(const Pool&) = delete;
+        Pool(Pool&& o) : vtable { o.vtable }, data { o.data }, size { o.size }, capacity { o.capacity } {
+            o.data = nullptr;
+            o.size = o.capacity = 0;
+        }
+        ~Pool() {
+            Clear();
+            if (data) {
+                ::operator delete(data, std::align_val_t(vtable->align));
+            }
+        }
 
-    using DestroyFunc = void(*)(void*);
+        void* At(size_t index) {
+            return data + index * vtable->size;
+        }
 
-    struct ResourceDestroyInfo {
-        uint32_t index;
-        DestroyFunc destroy;
+        // Returns uninitialized memory for a new last element.
+        void* Emplace() {
+            return Grow(1);
+        }
 
-        ResourceDestroyInfo(uint32_t index, DestroyFunc destroy) : index { index }, destroy { destroy } {}
-    };
+        // Returns uninitialized memory for `count` new last elements.
+        void* Grow(size_t count) {
+            if (size + count > capacity) {
+                Reserve(std::max({ size + count, capacity * 2, size_t(64) }));
+            }
+            auto first = At(size);
+            size += count;
+            return first;
+        }
 
-    using AssignFunc = std::function<void(void*)>;
+        // Makes room for `count` more elements, growing geometrically.
+        void ReserveMore(size_t count) {
+            if (size + count > capacity) {
+                Reserve(std::max(size + count, capacity * 2));
+            }
+        }
 
-    struct ComponentSpawnInfo {
-        AssignFunc assign;
-        World::Pool::CreateFunc create;
-        World::Pool::DestroyFunc destroy;
-        ComponentID index;
-    };
+        // Moves `count` elements from `src` to the end of the pool.
+        void Append(void* src, size_t count) {
+            ReserveMore(count);
+            vtable->RelocateRange(At(size), src, count);
+            size += count;
+        }
 
-    struct EntitySpawnInfo {
-        Entity entity;
-        std::vector<ComponentSpawnInfo> components;
+        void Reserve(size_t count) {
+            if (count <= capacity) {
+                return;
+            }
+            auto mem = (std::byte*)::operator new(count * vtable->size, std::align_val_t(vtable->align));
+            vtable->RelocateRange(mem, data, size);
+            if (data) {
+                ::operator delete(data, std::align_val_t(vtable->align));
+            }
+            data = mem;
+            capacity = count;
+        }
+
+        // Swap-and-pop, mirroring sparse_set::remove.
+        void Remove(size_t index) {
+            vtable->destroy(At(index));
+            if (index != size - 1) {
+                vtable->relocate(At(index), At(size - 1));
+            }
+            size--;
+        }
+
+        void Clear() {
+            for (size_t i = 0; i < size; i++) {
+                vtable->destroy(At(i));
+            }
+            size = 0;
+        }
     };
 
-    std::vector<Entity> destroyEntities;
-    std::vector<ResourceDestroyInfo> destroyResources_;
-    std::vector<EntitySpawnInfo> spawnEntities_;
+    struct ComponentInfo {
+        Pool pool;
+        EntitySet sparseSet;
 
-    template <typename T, typename... Remains>
-    void doSpawn(Entity entity, std::vector<ComponentSpawnInfo>& spawnInfo, T&& component, Remains&&... remains) {
-        ComponentSpawnInfo info;
-        info.index = IndexGetter<Component>::Get<T>();
-        info.create = [](void)->void* { return new T; };
-        info.destroy = [](void* elem) { delete (T*)(elem); };
-        info.assign = [=](void* elem) {
-            static auto com = component;
-            *((T*)elem) = com;
-        };
-        spawnInfo.push_back(info);
+        ComponentInfo(const ComponentVTable* vtable) : pool { vtable } {}
 
-        if constexpr (sizeof...(remains) != 0) {
-            doSpawn<Remains...>(entity, spawnInfo, std::forward<Remains...>(remains)...);
+        void* Get(Entity entity) {
+            return pool.At(sparseSet.index_of(entity));
         }
-    }
 
-    void* doSpawnWithoutType(Entity entity, ComponentSpawnInfo& info) {
-        if (auto it = world_.componentMap_.find(info.index); it == world_.componentMap_.end()) {
-            world_.componentMap_.emplace(info.index, World::ComponentInfo(info.create, info.destroy));
-        }
-        World::ComponentInfo& componentInfo = world_.componentMap_[info.index];
-        void* elem = componentInfo.pool.Create();
-        info.assign(elem);
-        componentInfo.sparseSet.add(entity);
-        return elem;
-    }
-    
-    void destroyEntity(Entity entity) {
-        if (auto it = world_.entities_.find(entity); it != world_.entities_.end()) {
-            for (auto [id, component] : it->second) {
-                auto& componentInfo = world_.componentMap_[id];
-                componentInfo.pool.Destroy(component);
-                componentInfo.sparseSet.remove(entity);
-            }
-            world_.entities_.erase(it);
+        void Remove(Entity entity) {
+            pool.Remove(sparseSet.index_of(entity));
+            sparseSet.remove(entity);
         }
+    };
+
+    using ComponentMap = std::unordered_map<ComponentID, ComponentInfo>;
+    ComponentMap componentMap_;
+    EntitySet entities_;
+    EntityAllocator entityIds_;
+
+    ComponentInfo* findComponent(ComponentID index) {
+        auto it = componentMap_.find(index);
+        return it == componentMap_.end() ? nullptr : &it->second;
     }
 
-    void removeResource(ResourceDestroyInfo& info) {
-        if (auto it = world_.resource_.find(info.index); it != world_.resource_.end()) {
-            info.destroy(it->second.resource);
-            it->second.resource = nullptr;
+    ComponentInfo& assureComponent(ComponentID index, const ComponentVTable* vtable) {
+        if (auto it = componentMap_.find(index); it != componentMap_.end()) {
+            return it->second;
         }
+        return componentMap_.emplace(index, ComponentInfo(vtable)).first->second;
     }
-};
-
-class Resources final {
-public:
-    Resources(World& world) : world_ { world } {}
 
     template <typename T>
-    bool Has() {
-        auto index = IndexGetter<Resource>::Get<T>();
-        auto it = world_.resource_.find(index);
-        return (it != world_.resource_.end() && it->second.resource);
+    ComponentInfo& assureComponent() {
+        return assureComponent(IndexGetter<Component>::Get<T>(), ComponentVTable::Of<T>());
     }
 
-    template <typename T>
-    T& Get() {
-        auto index = IndexGetter<Resource>::Get<T>();
-        return *((T*)world_.resource_[index].resource);
-    }
+    struct ResourceInfo {
+        void* resource = nullptr;
 
-private:
-    World& world_;
+        using DestroyFunc = void(*)(void*);
 
-};
+        DestroyFunc destroy = nullptr;
 
-class Queryer final {
-public:
-    Queryer(World& world) : world_ { world } {}
+        ResourceInfo(DestroyFunc destroy) : destroy { destroy } {
+            assertm("You must give a not-null destroy function", destroy);
+        }
+        ResourceInfo(const ResourceInfo&) = delete;
+        ResourceInfo(ResourceInfo&& o) : resource { o.resource }, destroy { o.destroy } {
+            o.resource = nullptr;
+        }
+        ~ResourceInfo() {
+            if (resource) {
+                destroy(resource);
+            }
+        }
+    };
 
-    template <typename... Components>
-    std::vector<Entity> Query() {
-        std::vector<Entity> entities;
-        doQuery<Components...>(entities);
-        return entities;
-    }
+    std::unordered_map<ComponentID, ResourceInfo> resource_;
+    std::vector<StartupSystem> startupSystems_;
 
-    template <typename T>
-    bool Has(Entity entity) {
-        auto index = IndexGetter<Component>::Get<T>();
-        auto it = world_.entities_.find(entity);
-        return (it != world_.entities_.end() && it->second.find(index) != it->second.end());
-    }
+    struct SystemInfo {
+        using RunFunc = void(*)(void*, World&, Commands&, SystemContext&);
+        using DestroyFunc = void(*)(void*);
 
-    template <typename T>
-    T& Get(Entity entity) {
-        auto index = IndexGetter<Component>::Get<T>();
-        return *((T*)world_.entities_[entity][index]);
+        void* system = nullptr;
+        RunFunc run = nullptr;
+        DestroyFunc destroy = nullptr;
+        Schedule schedule;
+        uint32_t phase = 0;
+        uint32_t runs = 0;
+        Access access;
+        SystemContext context;
+
+        SystemInfo(World& world) : context { world } {}
+        SystemInfo(const SystemInfo&) = delete;
+        SystemInfo(SystemInfo&& o) : system { o.system }, run { o.run }, destroy { o.destroy }, schedule { o.schedule },
+                                     phase { o.phase }, runs { o.runs }, access { std::move(o.access) }, context { std::move(o.context) } {
+            o.system = nullptr;
+        }
+        ~SystemInfo() {
+            if (system) {
+                destroy(system);
+            }
+        }
+    };
+
+    std::vector<SystemInfo> updateSystems_;
+    uint64_t tick_ = 0;
+
+    // One persistent buffer per system, parallel to the system lists. They
+    // are cleared by Execute but keep their memory for the next frame.
+    std::vector<Commands> startupCommands_;
+    std::vector<Commands> updateCommands_;
+    std::vector<Commands> resumableCommands_;
+
+    // Systems sharing a period are spread over the frames of that period, and
+    // staggered systems start on different slices, so the frame cost stays flat.
+    uint32_t leastLoadedPhase(const Schedule& schedule) const {
+        auto phases = std::max(schedule.period, schedule.slices);
+        if (phases == 1) {
+            return 0;
+        }
+        std::vector<uint32_t> load(phases, 0);
+        for (auto& info : updateSystems_) {
+            if (info.schedule.period == schedule.period && info.schedule.slices == schedule.slices) {
+                load[info.phase]++;
+            }
+        }
+        return uint32_t(std::min_element(load.begin(), load.end()) - load.begin());
     }
 
+    struct ResumableInfo {
+        using ErasedSystem = void(*)(void);
+        using RunFunc = TaskStatus(*)(ErasedSystem, void*, Commands&, Queryer, Resources, Events&, Budget&);
+        using CreateFunc = void*(*)(void);
+        using DestroyFunc = void(*)(void*);
 
-private:
-    World& world_;
+        ErasedSystem system = nullptr;
+        RunFunc run = nullptr;
+        CreateFunc create = nullptr;
+        DestroyFunc destroy = nullptr;
+        void* state = nullptr;
+        Budget::Clock::duration budget;
 
-    template <typename T, typename... Remains>
-    void doQuery(std::vector<Entity>& entities) {
-        auto index = IndexGetter<Component>::Get<T>();
-        World::ComponentInfo& info = world_.componentMap_[index];
-        for (auto e : info.sparseSet) {
-            if constexpr (sizeof...(Remains) != 0) {
-                doQueryRemains<Remains...>(e, entities);
+        ResumableInfo() = default;
+        ResumableInfo(const ResumableInfo&) = delete;
+        ResumableInfo(ResumableInfo&& o) : system { o.system }, run { o.run }, create { o.create }, destroy { o.destroy }, state { o.state }, budget { o.budget } {
+            o.state = nullptr;
+        }
+        ~ResumableInfo() {
+            if (state) {
+                destroy(state);
             }
-            else {
-                entities.push_back(e);
+        }
+    };
+
+    std::vector<ResumableInfo> resumableSystems_;
+    Events events_;
+    bool building_ = false;
+    // Set while Startup or Update runs; command buffers executed otherwise
+    // are external and go to the recorder.
+    bool running_ = false;
+    Recorder* recorder_ = nullptr;
+    Replayer* replayer_ = nullptr;
+
+    void record(Commands& commands);
+
+    // A single, possibly recycled ID when `count` is 0, otherwise `count`
+    // consecutive fresh ones. Goes through the recorder for the buffers a
+    // replay doesn't rebuild by running the systems again.
+    Entity reserve(uint32_t source, size_t count);
+
+    // One copy of each prefab component, in its own aligned allocation.
+    struct PrefabInfo final {
+        struct Prototype {
+            ComponentID index;
+            const ComponentVTable* vtable;
+            void* data;
+        };
+
+        std::vector<Prototype> components;
+
+        PrefabInfo() = default;
+        PrefabInfo(const PrefabInfo&) = delete;
+        PrefabInfo(PrefabInfo&&) = default;
+        ~PrefabInfo() {
+            for (auto& prototype : components) {
+                prototype.vtable->destroy(prototype.data);
+                ::operator delete(prototype.data, std::align_val_t(prototype.vtable->align));
+            }
+        }
+
+        template <typename T, typename Arg>
+        void Add(Arg&& value) {
+            auto data = ::operator new(sizeof(T), std::align_val_t(alignof(T)));
+            new (data) T(std::forward<Arg>(value));
+            components.push_back({ IndexGetter<Component>::Get<T>(), ComponentVTable::Of<T>(), data });
+        }
+    };
+
+    std::vector<PrefabInfo> prefabs_;
+
+    struct Hook final {
+        using CallFunc = void(*)(void*, Entity, void*);
+        using DestroyFunc = void(*)(void*);
+
+        void* func;
+        CallFunc call;
+        DestroyFunc destroy;
+
+        Hook(void* func, CallFunc call, DestroyFunc destroy) : func { func }, call { call }, destroy { destroy } {}
+        Hook(const Hook&) = delete;
+        Hook(Hook&& o) noexcept : func { o.func }, call { o.call }, destroy { o.destroy } {
+            o.func = nullptr;
+        }
+        ~Hook() {
+            if (func) {
+                destroy(func);
             }
         }
+    };
+
+    struct ComponentHooks {
+        std::vector<Hook> onAdd;
+        std::vector<Hook> onRemove;
+        std::vector<Hook> onReplace;
+    };
+
+    using HookList = std::vector<Hook> ComponentHooks::*;
+
+    // Indexed by component ID.
+    std::vector<ComponentHooks> hooks_;
+
+    template <typename T, typename Func>
+    static Hook makeHook(Func&& func) {
+        using Stored = std::decay_t<Func>;
+        return Hook(
+            new Stored(std::forward<Func>(func)),
+            [](void* func, Entity entity, void* component) { (*(Stored*)func)(entity, *(T*)component); },
+            [](void* func) { delete (Stored*)func; });
+    }
+
+    ComponentHooks& assureHooks(ComponentID index) {
+        if (index >= hooks_.size()) {
+            hooks_.resize(index + 1);
+        }
+        return hooks_[index];
     }
 
-    template <typename T, typename... Remains>
-    void doQueryRemains(Entity entity, std::vector<Entity>& entities) {
-        auto index = IndexGetter<Component>::Get<T>();
-        auto& componentContainer = world_.entities_[entity];
-        if (auto it = componentContainer.find(index); it == componentContainer.end()) {
+    bool hasHooks(ComponentID index, HookList list) const {
+        return index < hooks_.size() && !(hooks_[index].*list).empty();
+    }
+
+    void notify(ComponentID index, HookList list, Entity entity, void* component) {
+        if (!hasHooks(index, list)) {
             return;
         }
+        for (auto& hook : hooks_[index].*list) {
+            hook.call(hook.func, entity, component);
+        }
+    }
 
-        if constexpr (sizeof...(Remains) == 0) {
-            entities.push_back(entity);
+    // Runs the hooks for the components in pool slots [first, first + count).
+    void notifyRange(ComponentID index, HookList list, ComponentInfo& info, size_t first, size_t count) {
+        if (!hasHooks(index, list)) {
             return;
         }
-        else {
-            return doQueryRemains<Remains...>(entity, entities);
+        auto entities = info.sparseSet.begin() + first;
+        for (size_t i = 0; i < count; i++) {
+            for (auto& hook : hooks_[index].*list) {
+                hook.call(hook.func, entities[i], info.pool.At(first + i));
+            }
         }
     }
-};
 
-inline void World::Startup() {
-    std::vector<Commands> commandList;
-    for (auto sys : startupSystems_) {
-        Commands commands{*this};
-        sys(commands);
-        commandList.push_back(commands);
+    // Every removal goes through these two, so OnRemove sees each component.
+    void removeComponent(ComponentID index, ComponentInfo& info, Entity entity) {
+        notify(index, &ComponentHooks::onRemove, entity, info.Get(entity));
+        info.Remove(entity);
     }
 
-    for (auto& commands : commandList) {
-        commands.Execute();
+    void clearComponent(ComponentID index, ComponentInfo& info) {
+        notifyRange(index, &ComponentHooks::onRemove, info, 0, info.pool.size);
+        info.pool.Clear();
+        info.sparseSet.reset();
     }
+};
+
+// Constructs the index-th element of each array in `arrays` from the
+// matching element of the `values` tuple.
+template <typename Arrays, typename Values, size_t... Is>
+void constructAt(Arrays& arrays, size_t index, Values&& values, std::index_sequence<Is...>) {
+    (new (std::get<Is>(arrays) + index) std::remove_pointer_t<std::tuple_element_t<Is, Arrays>>(std::get<Is>(std::forward<Values>(values))), ...);
 }
 
-inline void World::Update() {
-    std::vector<Commands> commandList;
-    for (auto sys : updateSystems_) {
-        Commands commands{*this};
-        sys(commands, Queryer{*this}, Resources{*this}, events_);
-        commandList.push_back(commands);
+// Fills `count` elements of each array from `generator(i)`, which returns
+// a std::tuple of the components, or a plain value if there is only one.
+// Shared by Commands and World::Builder.
+template <typename... ComponentTypes, typename Generator>
+void generate(std::tuple<ComponentTypes*...>& arrays, size_t count, Generator& generator) {
+    for (size_t i = 0; i < count; i++) {
+        if constexpr (sizeof...(ComponentTypes) == 1 && std::is_convertible_v<decltype(generator(i)), std::tuple_element_t<0, std::tuple<ComponentTypes...>>>) {
+            constructAt(arrays, i, std::forward_as_tuple(generator(i)), std::index_sequence_for<ComponentTypes...>{});
+        }
+        else {
+            constructAt(arrays, i, generator(i), std::index_sequence_for<ComponentTypes...>{});
+        }
+    }
+}
+
+// Linear storage for recorded commands. Records never straddle blocks and
+// blocks are never reallocated, so payloads that are not trivially
+// relocatable stay valid until they are replayed. Clear keeps the blocks.
+class CommandArena final {
+public:
+    static constexpr size_t Alignment = alignof(std::max_align_t);
+
+    // Returns at least `bytes` contiguous bytes at the end of the arena.
+    std::byte* Reserve(size_t bytes) {
+        if (current_ < blocks_.size() && blocks_[current_].used + bytes <= blocks_[current_].capacity) {
+            return blocks_[current_].data.get() + blocks_[current_].used;
+        }
+        while (++current_ < blocks_.size()) {
+            if (bytes <= blocks_[current_].capacity) {
+                return blocks_[current_].data.get();
+            }
+        }
+        auto capacity = std::max({ bytes, size_t(4096), blocks_.empty() ? 0 : blocks_.back().capacity * 2 });
+        blocks_.push_back(Block{ std::make_unique<std::byte[]>(capacity), capacity, 0 });
+        current_ = blocks_.size() - 1;
+        return blocks_.back().data.get();
     }
-    events_.removeOldEvents();
-    events_.addAllEvents();
 
-    for (auto& commands : commandList) {
-        commands.Execute();
+    // Commits `bytes` of the region returned by the last Reserve.
+    void Advance(size_t bytes) {
+        auto& block = blocks_[current_];
+        block.used = std::min(block.capacity, alignUp(block.used + bytes));
     }
+
+    // Calls `func` with the start of each record in recording order; it must
+    // return the size of that record.
+    template <typename Func>
+    void Walk(Func&& func) {
+        for (size_t i = 0; i <= current_ && i < blocks_.size(); i++) {
+            auto& block = blocks_[i];
+            size_t pos = 0;
+            while (pos < block.used) {
+                pos = alignUp(pos + func(block.data.get() + pos));
+            }
+        }
+    }
+
+    void Clear() {
+        size_t used = 0;
+        for (auto& block : blocks_) {
+            used += block.used;
+            block.used = 0;
+        }
+        highWater_ = std::max(highWater_, used);
+        current_ = 0;
+    }
+
+    size_t HighWater() const {
+        return highWater_;
+    }
+
+    size_t Capacity() const {
+        size_t capacity = 0;
+        for (auto& block : blocks_) {
+            capacity += block.capacity;
+        }
+        return capacity;
+    }
+
+    bool Empty() const {
+        return blocks_.empty() || (current_ == 0 && blocks_[0].used == 0);
+    }
+
+    static std::byte* AlignUp(std::byte* ptr, size_t align) {
+        return (std::byte*)((reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~(uintptr_t(align) - 1));
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t capacity;
+        size_t used;
+    };
+
+    std::vector<Block> blocks_;
+    size_t current_ = 0;
+    size_t highWater_ = 0;
+
+    static size_t alignUp(size_t size) {
+        return (size + Alignment - 1) & ~(Alignment - 1);
+    }
+};
+
+// Append-only binary log of what a World took in from outside, frame by
+// frame: external command buffers, the Startup and Update calls, and the
+// events published at each Update. An entry is a channel word and a count
+// followed by raw bytes; the frame index holds where each frame starts.
+// Payloads are copied byte for byte, so a log only replays on a build with
+// the same type layouts.
+class ReplayLog final {
+public:
+    friend class ReplaySchema;
+    friend class Commands;
+    friend class Recorder;
+    friend class Replayer;
+
+    size_t Frames() const { return frames_.size(); }
+    size_t Bytes() const { return data_.size(); }
+
+    // The entries of one frame. The last frame is still open while an
+    // Update is being recorded.
+    Span<const std::byte> Frame(size_t index) const {
+        auto end = index + 1 < frames_.size() ? frames_[index + 1] : data_.size();
+        return Span<const std::byte>(data_.data() + frames_[index], size_t(end - frames_[index]));
+    }
+
+    void Save(std::ostream& out) const {
+        write(out, Magic);
+        writeVector(out, layout_);
+        writeVector(out, frames_);
+        writeVector(out, data_);
+    }
+
+    // Returns false, and leaves the log empty, if the stream doesn't hold a
+    // whole log or its framing is broken. Every entry is checked up front,
+    // so replaying a loaded log never reads outside of it.
+    bool Load(std::istream& in) {
+        uint32_t magic = 0;
+        open_ = false;
+        if (read(in, magic) && magic == Magic && readVector(in, layout_) && readVector(in, frames_) && readVector(in, data_) && valid()) {
+            return true;
+        }
+        layout_.clear();
+        frames_.clear();
+        data_.clear();
+        return false;
+    }
+
+private:
+    static constexpr uint32_t Magic = 0x4c524751; // "QGRL"
+
+    // Entry channels besides the schema's event channels. Commands and
+    // reservation entries start with their source: External, or the index of
+    // the LiveOnly system that made them. A reservation entry has the count
+    // given to World::reserve and is followed by the first ID taken; replay
+    // takes IDs the same way and checks it gets it.
+    static constexpr uint32_t CommandsEntry = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t StartupEntry = CommandsEntry - 1;
+    static constexpr uint32_t UpdateEntry = CommandsEntry - 2;
+    static constexpr uint32_t ReserveEntry = CommandsEntry - 3;
+    static constexpr uint32_t External = std::numeric_limits<uint32_t>::max();
+
+    // The event count, then each event type's size and alignment, then the
+    // component count and each component type's size. Checked against the
+    // schema before replaying.
+    std::vector<uint32_t> layout_;
+    std::vector<uint64_t> frames_;
+    std::vector<std::byte> data_;
+    bool open_ = false;
+
+    // Starts an entry, and a frame if none is open. Returns the offset of
+    // the count, for patch.
+    size_t begin(uint32_t channel, uint32_t count) {
+        if (!open_) {
+            frames_.push_back(data_.size());
+            open_ = true;
+        }
+        put(channel);
+        put(count);
+        return data_.size() - sizeof(uint32_t);
+    }
+
+    void endFrame() {
+        open_ = false;
+    }
+
+    void put(const void* bytes, size_t size) {
+        auto at = data_.size();
+        data_.resize(at + size);
+        if (size) {
+            std::memcpy(data_.data() + at, bytes, size);
+        }
+    }
+
+    template <typename T>
+    void put(const T& value) {
+        put(&value, sizeof(T));
+    }
+
+    void patch(size_t at, uint32_t value) {
+        std::memcpy(data_.data() + at, &value, sizeof(value));
+    }
+
+    // Pads with zeros to a multiple of `align`. The data buffer is aligned
+    // for any fundamental type, so offsets and addresses agree.
+    void pad(size_t align) {
+        data_.resize((data_.size() + align - 1) & ~(align - 1));
+    }
+
+    template <typename T>
+    static T take(const std::byte*& cursor) {
+        T value;
+        std::memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+        return value;
+    }
+
+    static const std::byte* alignUp(const std::byte* cursor, size_t align) {
+        return (const std::byte*)((reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(uintptr_t(align) - 1));
+    }
+
+    template <typename T>
+    static void write(std::ostream& out, const T& value) {
+        out.write((const char*)&value, sizeof(T));
+    }
+
+    template <typename T>
+    static void writeVector(std::ostream& out, const std::vector<T>& values) {
+        write(out, uint64_t(values.size()));
+        out.write((const char*)values.data(), std::streamsize(values.size() * sizeof(T)));
+    }
+
+    template <typename T>
+    static bool read(std::istream& in, T& value) {
+        return bool(in.read((char*)&value, sizeof(T)));
+    }
+
+    // Grows in chunks, so a corrupt size fails at the end of the stream
+    // instead of allocating whatever it says.
+    template <typename T>
+    static bool readVector(std::istream& in, std::vector<T>& values) {
+        uint64_t size = 0;
+        if (!read(in, size)) {
+            return false;
+        }
+        values.clear();
+        while (values.size() < size) {
+            auto at = values.size();
+            auto chunk = std::min<uint64_t>(size - at, 1 << 16);
+            values.resize(at + chunk);
+            if (!in.read((char*)(values.data() + at), std::streamsize(chunk * sizeof(T)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Bounds-checked reads over one frame or entry.
+    struct Reader {
+        const std::byte* at;
+        const std::byte* end;
+
+        bool skip(uint64_t bytes) {
+            if (bytes > uint64_t(end - at)) {
+                return false;
+            }
+            at += bytes;
+            return true;
+        }
+
+        bool take(uint32_t& value) {
+            if (!skip(sizeof(value))) {
+                return false;
+            }
+            std::memcpy(&value, at - sizeof(value), sizeof(value));
+            return true;
+        }
+    };
+
+    bool valid() const {
+        if (layout_.empty() || layout_.size() < 2 + 2 * size_t(layout_[0]) ||
+            layout_.size() != 2 + 2 * size_t(layout_[0]) + layout_[1 + 2 * size_t(layout_[0])]) {
+            return false;
+        }
+        if (frames_.empty() != data_.empty() || (!frames_.empty() && frames_[0] != 0)) {
+            return false;
+        }
+        for (size_t i = 0; i < frames_.size(); i++) {
+            auto end = i + 1 < frames_.size() ? frames_[i + 1] : data_.size();
+            if (end <= frames_[i] || end > data_.size() || !validFrame(Frame(i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // External reservations and commands and Startup come first; an Update
+    // may follow, then the reservations of its LiveOnly systems, its events
+    // in channel order and the commands of its LiveOnly systems.
+    bool validFrame(Span<const std::byte> frame) const {
+        Reader reader { frame.begin(), frame.end() };
+        uint32_t events = layout_[0];
+        bool updated = false;
+        bool executed = false;
+        uint32_t next = 0;
+        while (reader.at != reader.end) {
+            uint32_t channel = 0, count = 0, source = 0;
+            if (!reader.take(channel) || !reader.take(count)) {
+                return false;
+            }
+            if ((channel == CommandsEntry || channel == ReserveEntry) && (!reader.take(source) || (source != External) != updated)) {
+                return false;
+            }
+            if (channel == CommandsEntry) {
+                auto first = reader.at;
+                if (!reader.skip(count) || !validCommands(Reader{ first, reader.at })) {
+                    return false;
+                }
+                executed = updated;
+            }
+            else if (channel == ReserveEntry && next == 0 && !executed) {
+                if (!reader.skip(sizeof(Entity))) {
+                    return false;
+                }
+            }
+            else if ((channel == StartupEntry || channel == UpdateEntry) && !updated && count == 0) {
+                updated = channel == UpdateEntry;
+            }
+            else if (updated && !executed && channel < events && channel >= next && count > 0) {
+                auto size = layout_[1 + 2 * channel];
+                auto align = layout_[2 + 2 * channel];
+                if (align == 0 || (align & (align - 1)) != 0 || !reader.skip(alignUp(reader.at, align) - reader.at) ||
+                    !reader.skip(uint64_t(size) * count)) {
+                    return false;
+                }
+                next = channel + 1;
+            }
+            else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Mirrors Commands::serialize.
+    bool validCommands(Reader reader) const {
+        auto components = layout_.data() + 1 + 2 * size_t(layout_[0]);
+        uint32_t count = 0, value = 0, wire = 0;
+        auto component = [&](uint64_t instances) {
+            return reader.take(wire) && wire < components[0] && reader.skip(uint64_t(components[1 + wire]) * instances);
+        };
+        if (!reader.take(count) || !reader.skip(uint64_t(count) * sizeof(Entity)) || !reader.take(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t ids = 0;
+            if (!reader.take(value) || !reader.take(ids)) {
+                return false;
+            }
+            for (uint32_t j = 0; j < ids; j++) {
+                if (!component(0)) {
+                    return false;
+                }
+            }
+        }
+        if (!reader.take(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t instances = 0, types = 0;
+            if (!reader.skip(sizeof(Entity)) || !reader.take(instances) || !reader.take(types) || !reader.take(value)) {
+                return false;
+            }
+            for (uint32_t j = 0; j < types; j++) {
+                if (!component(instances)) {
+                    return false;
+                }
+            }
+        }
+        if (!reader.take(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t insert = 0;
+            if (!reader.skip(sizeof(Entity)) || !reader.take(wire) || wire >= components[0] || !reader.take(insert) ||
+                (insert && !reader.skip(components[1 + wire]))) {
+                return false;
+            }
+        }
+        return reader.at == reader.end;
+    }
+};
+
+// The event and component types a log carries, numbered in declaration
+// order: the recording and the replaying side must declare the same types
+// in the same order. Everything is copied as raw bytes, so the types must
+// be trivially copyable.
+class ReplaySchema final {
+public:
+    friend class Commands;
+    friend class Recorder;
+    friend class Replayer;
+
+    // Events of T are recorded as published at each Update. On replay the
+    // log is authoritative for T: whatever systems wrote is replaced by the
+    // recorded generation.
+    template <typename T>
+    ReplaySchema& Event() {
+        static_assert(std::is_trivially_copyable_v<T>, "recorded events are copied as raw bytes");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "recorded events can't be over-aligned");
+        events_.push_back({
+            uint32_t(sizeof(T)),
+            uint32_t(alignof(T)),
+            [](Events& events, ReplayLog& log, uint32_t channel) {
+                auto& queue = events.assureQueue<T>();
+                auto published = queue.Run(queue.Latest());
+                if (published.empty()) {
+                    return;
+                }
+                log.begin(channel, uint32_t(published.size()));
+                log.pad(alignof(T));
+                log.put(published.data(), published.size() * sizeof(T));
+            },
+            [](Events& events, const std::byte* data, uint32_t count) {
+                events.assureQueue<T>().Republish((const T*)data, count);
+            },
+        });
+        return *this;
+    }
+
+    // Lets recorded command buffers carry T, in spawns, inserts, removes
+    // and bulk commands.
+    template <typename T>
+    ReplaySchema& Component() {
+        static_assert(std::is_trivially_copyable_v<T>, "recorded components are copied as raw bytes");
+        auto index = IndexGetter<ecs::Component>::Get<T>();
+        if (index >= wireIds_.size()) {
+            wireIds_.resize(index + 1, NoWire);
+        }
+        wireIds_[index] = uint32_t(components_.size());
+        components_.push_back({ index, ComponentVTable::Of<T>() });
+        return *this;
+    }
+
+private:
+    struct EventChannel {
+        uint32_t size;
+        uint32_t align;
+        void (*capture)(Events&, ReplayLog&, uint32_t channel);
+        void (*publish)(Events&, const std::byte* data, uint32_t count);
+    };
+
+    struct ComponentChannel {
+        ComponentID index;
+        const ComponentVTable* vtable;
+    };
+
+    static constexpr uint32_t NoWire = std::numeric_limits<uint32_t>::max();
+
+    std::vector<EventChannel> events_;
+    std::vector<ComponentChannel> components_;
+    // Wire ID of each component, indexed by component ID.
+    std::vector<uint32_t> wireIds_;
+
+    uint32_t wireID(ComponentID index) const {
+        assertm("component type isn't in the replay schema", index < wireIds_.size() && wireIds_[index] != NoWire);
+        return wireIds_[index];
+    }
+
+    std::vector<uint32_t> layout() const {
+        std::vector<uint32_t> layout { uint32_t(events_.size()) };
+        for (auto& channel : events_) {
+            layout.push_back(channel.size);
+            layout.push_back(channel.align);
+        }
+        layout.push_back(uint32_t(components_.size()));
+        for (auto& channel : components_) {
+            layout.push_back(uint32_t(channel.vtable->size));
+        }
+        return layout;
+    }
+};
+
+class Commands final {
+public:
+    friend class World;
+    friend class Recorder;
+    friend class Replayer;
+
+    // Peak usage between two Executes, summed over the worker buffers, and
+    // the memory currently held for reuse.
+    struct Stats {
+        size_t spawnBytes = 0;
+        size_t editBytes = 0;
+        size_t destroys = 0;
+        size_t reservedBytes = 0;
+    };
+
+    Commands(World& world) : world_ { world } {}
+    Commands(const Commands&) = delete;
+    Commands(Commands&&) = default;
+    ~Commands() {
+        discard();
+    }
+
+    // The entity ID is assigned when the buffer is executed, so spawns recorded
+    // from worker buffers get the same IDs no matter how the workers were timed.
+    //
+    // Component types may be given explicitly (Spawn<Mesh>(mesh)) or deduced
+    // from the arguments. Each component is constructed in place from its
+    // forwarded argument and later moved into its pool; nothing is default
+    // constructed or assigned, so move-only types work.
+    template <typename... ComponentTypes, typename... Args>
+    Commands& Spawn(Args&&... components) {
+        recordSpawn<ComponentTypes...>(NullEntity, std::forward<Args>(components)...);
+        return *this;
+    }
+
+    // Takes the ID while recording, so it isn't available on worker buffers.
+    template <typename... ComponentTypes, typename... Args>
+    Entity Spawn_r(Args&&... components) {
+        assertm("Spawn_r on a worker buffer would make IDs depend on thread timing; use Spawn or SpawnAt", !worker_);
+        auto entity = world_.reserve(source_, 0);
+        recordSpawn<ComponentTypes...>(entity, std::forward<Args>(components)...);
+        return entity;
+    }
+
+    // Spawns an entity whose ID was taken earlier with World::ReserveEntity
+    // or ReserveEntities.
+    template <typename... ComponentTypes, typename... Args>
+    Commands& SpawnAt(Entity entity, Args&&... components) {
+        assertm("You must give a reserved entity", entity != NullEntity);
+        recordSpawn<ComponentTypes...>(entity, std::forward<Args>(components)...);
+        return *this;
+    }
+
+    // Destroying an entity that Spawn_r recorded in the same buffer cancels
+    // the spawn; the entity never becomes alive.
+    Commands& Destroy(Entity entity) {
+        destroyEntities.push_back(entity);
+        return *this;
+    }
+
+    // Adds a component to an existing entity, or replaces the one it has.
+    // Inserts and removes are applied after spawns and only touch the
+    // storage of that component type. They are coalesced: of several edits
+    // to the same (component, entity) pair only the last one recorded takes
+    // effect, and the survivors are applied, with their hooks, grouped by
+    // component type and sorted by entity.
+    template <typename T = void, typename Arg>
+    Commands& Insert(Entity entity, Arg&& component) {
+        using Type = std::conditional_t<std::is_void_v<T>, std::decay_t<Arg>, T>;
+        return Emplace<Type>(entity, std::forward<Arg>(component));
+    }
+
+    // Like Insert, but constructs T in place from `args`.
+    template <typename T, typename... Args>
+    Commands& Emplace(Entity entity, Args&&... args) {
+        auto begin = edits_.Reserve(sizeof(EditRecord) + alignof(T) - 1 + sizeof(T));
+        auto payload = CommandArena::AlignUp(begin + sizeof(EditRecord), alignof(T));
+        new (payload) T(std::forward<Args>(args)...);
+        auto bytes = size_t(payload + sizeof(T) - begin);
+        new (begin) EditRecord{ entity, IndexGetter<Component>::Get<T>(), ComponentVTable::Of<T>(), bytes };
+        edits_.Advance(bytes);
+        return *this;
+    }
+
+    template <typename T>
+    Commands& Remove(Entity entity) {
+        auto begin = edits_.Reserve(sizeof(EditRecord));
+        new (begin) EditRecord{ entity, IndexGetter<Component>::Get<T>(), nullptr, sizeof(EditRecord) };
+        edits_.Advance(sizeof(EditRecord));
+        return *this;
+    }
+
+    // Destroys every entity that has all the Filter components. Bulk commands
+    // run right after Destroy, so they don't see this buffer's spawns.
+    template <typename... Filter>
+    Commands& DestroyAll() {
+        static_assert(sizeof...(Filter) > 0, "DestroyAll needs at least one component type");
+        bulk_.push_back({ uint32_t(bulkIds_.size()), uint32_t(sizeof...(Filter)), true });
+        (bulkIds_.push_back(IndexGetter<Component>::Get<Filter>()), ...);
+        return *this;
+    }
+
+    // Removes T from every entity that has it.
+    template <typename T>
+    Commands& RemoveAll() {
+        bulk_.push_back({ uint32_t(bulkIds_.size()), 1, false });
+        bulkIds_.push_back(IndexGetter<Component>::Get<T>());
+        return *this;
+    }
+
+    // Records `count` entities at once. `generator(i)` returns the components
+    // of the i-th entity as a std::tuple, or as a plain value if there is only
+    // one component type. Execute reserves IDs and storage once for the batch.
+    template <typename... ComponentTypes, typename Generator>
+    Commands& SpawnBatch(size_t count, Generator&& generator) {
+        static_assert(sizeof...(ComponentTypes) > 0, "batch needs at least one component");
+        auto arrays = recordBatch<ComponentTypes...>(NullEntity, count);
+        generate(arrays, count, generator);
+        return *this;
+    }
+
+    // Spawns `count` copies of a prefab. Each component is copied straight
+    // from the prefab into its pool at Execute, with memcpy for trivially
+    // copyable types. The generator follows the SpawnBatch contract and gives
+    // per-instance values for the Overrides types, replacing the prefab's.
+    template <typename... Overrides, typename Generator>
+    Commands& Instantiate(Prefab prefab, size_t count, Generator&& generator) {
+        assertm("unknown prefab", prefab.index < world_.prefabs_.size());
+        auto arrays = recordBatch<Overrides...>(NullEntity, count, prefab.index);
+        generate(arrays, count, generator);
+        return *this;
+    }
+
+    Commands& Instantiate(Prefab prefab, size_t count) {
+        assertm("unknown prefab", prefab.index < world_.prefabs_.size());
+        recordBatch<>(NullEntity, count, prefab.index);
+        return *this;
+    }
+
+    // Copies the i-th element of every span into the i-th entity.
+    template <typename... ComponentTypes>
+    Commands& SpawnBatch(Span<const ComponentTypes>... components) {
+        static_assert(sizeof...(ComponentTypes) > 0, "batch needs at least one component");
+        size_t count = std::get<0>(std::forward_as_tuple(components...)).size();
+        assertm("all component spans must have the same size", ((components.size() == count) && ...));
+        auto arrays = recordBatch<ComponentTypes...>(NullEntity, count);
+        copyArrays(arrays, std::forward_as_tuple(components...), std::index_sequence_for<ComponentTypes...>{});
+        return *this;
+    }
+
+    template <typename T> 
+    Commands& SetResource(T&& resource) {
+        return EmplaceResource<std::decay_t<T>>(std::forward<T>(resource));
+    }
+
+    // Constructs the resource in place from `args`, replacing any old value.
+    // Unlike the other commands this takes effect at once, so it isn't
+    // available on worker buffers.
+    template <typename T, typename... Args>
+    Commands& EmplaceResource(Args&&... args) {
+        assertm("resources can't be set from a worker buffer", !worker_);
+        auto index = IndexGetter<Resource>::Get<T>();
+        auto it = world_.resource_.find(index);
+        if (it == world_.resource_.end()) {
+            it = world_.resource_.emplace(index, World::ResourceInfo([](void* elem) { delete (T*)(elem); })).first;
+        }
+        auto& info = it->second;
+        if (info.resource) {
+            info.destroy(info.resource);
+            info.resource = nullptr;
+        }
+        info.resource = new T(std::forward<Args>(args)...);
+        return *this;
+    }
+
+    template <typename T>
+    Commands& RemoveResource() {
+        auto index = IndexGetter<Resource>::Get<T>();
+        destroyResources_.push_back(ResourceDestroyInfo(index, [](void* elem) { delete (T*)elem; }));
+        return *this;
+    }
+
+    // Readies `count` worker-local buffers. Call it before the workers start;
+    // afterwards each worker records into its own Worker(i) without locking.
+    // Worker buffers are kept after Execute and reused by the next Fork.
+    Commands& Fork(size_t count) {
+        assertm("worker buffers must be merged before forking again", activeWorkers_ == 0);
+        while (workers_.size() < count) {
+            workers_.emplace_back(world_).worker_ = true;
+        }
+        activeWorkers_ = count;
+        return *this;
+    }
+
+    // IDs are handed out at Execute in worker index order, so Spawn, and
+    // SpawnAt with IDs reserved before the fork, give the same entities
+    // however the workers are timed. Spawn_r, SetResource and
+    // EmplaceResource, which touch the World while recording, assert on a
+    // worker buffer.
+    Commands& Worker(size_t index) {
+        assertm("worker index out of range", index < activeWorkers_);
+        return workers_[index];
+    }
+
+    size_t WorkerCount() const {
+        return activeWorkers_;
+    }
+
+    Stats HighWater() const {
+        Stats stats;
+        stats.spawnBytes = spawns_.HighWater();
+        stats.editBytes = edits_.HighWater();
+        stats.destroys = destroysHighWater_;
+        stats.reservedBytes = spawns_.Capacity() + edits_.Capacity() +
+                              destroyEntities.capacity() * sizeof(Entity) + destroyResources_.capacity() * sizeof(ResourceDestroyInfo);
+        for (auto& worker : workers_) {
+            auto sub = worker.HighWater();
+            stats.spawnBytes += sub.spawnBytes;
+            stats.editBytes += sub.editBytes;
+            stats.destroys += sub.destroys;
+            stats.reservedBytes += sub.reservedBytes;
+        }
+        return stats;
+    }
+
+    void Execute() {
+        merge();
+        world_.record(*this);
+        destroysHighWater_ = std::max(destroysHighWater_, destroyEntities.size());
+        coalesce();
+
+        for (auto e : destroyEntities) {
+            destroyEntity(e);
+        } 
+        for (auto& info : destroyResources_) {
+            removeResource(info);
+        }
+        executeBulk();
+        executeSpawns();
+        executeEdits();
+
+        destroyEntities.clear();
+        destroyResources_.clear();
+        bulk_.clear();
+        bulkIds_.clear();
+        activeWorkers_ = 0;
+    }
+
+private:
+    World& world_;
+
+    using DestroyFunc = void(*)(void*);
+
+    struct ResourceDestroyInfo {
+        uint32_t index;
+        DestroyFunc destroy;
+
+        ResourceDestroyInfo(uint32_t index, DestroyFunc destroy) : index { index }, destroy { destroy } {}
+    };
+
+    // A spawn is one SpawnRecord for `count` consecutive entities, followed by
+    // a ComponentRecord per component type, each followed by an array of
+    // `count` payloads aligned for that type. A single Spawn has count 1.
+    // Instances of a prefab also get its components that aren't recorded.
+    struct SpawnRecord {
+        Entity entity;
+        uint32_t count;
+        uint32_t components;
+        uint32_t prefab;
+        size_t bytes;
+    };
+
+    static constexpr uint32_t NoPrefab = std::numeric_limits<uint32_t>::max();
+
+    struct ComponentRecord {
+        const ComponentVTable* vtable;
+        ComponentID index;
+    };
+
+    std::vector<Entity> destroyEntities;
+    std::vector<ResourceDestroyInfo> destroyResources_;
+    // An insert carries the component's vtable and is followed by its payload;
+    // a remove has a null vtable and no payload.
+    struct EditRecord {
+        Entity entity;
+        ComponentID index;
+        const ComponentVTable* vtable;
+        size_t bytes;
+    };
+
+    CommandArena spawns_;
+    CommandArena edits_;
+    std::vector<Commands> workers_;
+    size_t activeWorkers_ = 0;
+    bool worker_ = false;
+
+    // Who records into this buffer: the application, a LiveOnly system by
+    // its index, or one of the other systems, whose buffers a replay rebuilds
+    // by running them again. Only the latter go unrecorded.
+    static constexpr uint32_t External = ReplayLog::External;
+    static constexpr uint32_t Rerun = External - 1;
+
+    uint32_t source_ = External;
+    size_t destroysHighWater_ = 0;
+
+    // Scratch for Execute, kept across frames so coalescing stays allocation
+    // free. Spawned payloads are grouped per component type; a type keeps its
+    // slot in spawnGroups_ for the lifetime of the buffer.
+    // A run either relocates recorded payloads or fills from a prototype.
+    struct SpawnRun {
+        std::byte* payload;
+        const void* prototype;
+        Entity entity;
+        uint32_t count;
+    };
+
+    struct SpawnGroup {
+        ComponentID index;
+        const ComponentVTable* vtable;
+        size_t total = 0;
+        size_t first = 0;
+        std::vector<SpawnRun> runs;
+    };
+
+    static constexpr uint32_t NoGroup = std::numeric_limits<uint32_t>::max();
+
+    std::vector<SpawnGroup> spawnGroups_;
+    std::vector<uint32_t> groupSlots_;
+
+    // An edit and its place in recording order, which breaks ties between
+    // edits to the same pair without a stable sort and its buffer.
+    struct PendingEdit {
+        EditRecord* edit;
+        size_t seq;
+    };
+
+    std::vector<PendingEdit> pendingEdits_;
+
+    // A bulk command covers the entities that have all `count` component
+    // types starting at bulkIds_[first]. RemoveAll has a single type.
+    struct BulkRecord {
+        uint32_t first;
+        uint32_t count;
+        bool destroy;
+    };
+
+    std::vector<BulkRecord> bulk_;
+    std::vector<ComponentID> bulkIds_;
+    std::vector<EntitySet*> bulkSets_;
+    std::vector<Entity> bulkMatched_;
+
+    // Appends the worker buffers in index order, never in completion order,
+    // so the merged command stream is the same on every run. Spawns stay in
+    // the worker arenas and are replayed after this buffer's own.
+    void merge() {
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            auto& worker = workers_[i];
+            worker.merge();
+            destroyEntities.insert(destroyEntities.end(), worker.destroyEntities.begin(), worker.destroyEntities.end());
+            destroyResources_.insert(destroyResources_.end(), worker.destroyResources_.begin(), worker.destroyResources_.end());
+            for (auto op : worker.bulk_) {
+                op.first += uint32_t(bulkIds_.size());
+                bulk_.push_back(op);
+            }
+            bulkIds_.insert(bulkIds_.end(), worker.bulkIds_.begin(), worker.bulkIds_.end());
+            worker.destroyEntities.clear();
+            worker.destroyResources_.clear();
+            worker.bulk_.clear();
+            worker.bulkIds_.clear();
+        }
+    }
+
+    bool idle() const {
+        if (!destroyEntities.empty() || !destroyResources_.empty() || !bulk_.empty() || !spawns_.Empty() || !edits_.Empty()) {
+            return false;
+        }
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            if (!workers_[i].idle()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Replay wire format of a merged buffer: destroys, bulk commands, then
+    // spawns and edits in the order Execute walks them. Components are
+    // written by their schema wire ID, payloads as raw bytes.
+    void serialize(ReplayLog& log, const ReplaySchema& schema) {
+        assertm("resource commands can't be recorded", destroyResources_.empty());
+        log.put(uint32_t(destroyEntities.size()));
+        log.put(destroyEntities.data(), destroyEntities.size() * sizeof(Entity));
+        log.put(uint32_t(bulk_.size()));
+        for (auto& op : bulk_) {
+            log.put(uint32_t(op.destroy));
+            log.put(op.count);
+            for (uint32_t i = 0; i < op.count; i++) {
+                log.put(schema.wireID(bulkIds_[op.first + i]));
+            }
+        }
+        auto spawns = log.Bytes();
+        uint32_t count = 0;
+        log.put(count);
+        serializeSpawns(log, schema, count);
+        log.patch(spawns, count);
+        auto edits = log.Bytes();
+        count = 0;
+        log.put(count);
+        serializeEdits(log, schema, count);
+        log.patch(edits, count);
+    }
+
+    void serializeSpawns(ReplayLog& log, const ReplaySchema& schema, uint32_t& count) {
+        spawns_.Walk([&](std::byte* begin) {
+            auto spawn = (SpawnRecord*)begin;
+            log.put(spawn->entity);
+            log.put(spawn->count);
+            log.put(spawn->components);
+            log.put(spawn->prefab);
+            forEachComponent(begin, [&](ComponentRecord& record, std::byte* payload) {
+                log.put(schema.wireID(record.index));
+                log.put(payload, record.vtable->size * spawn->count);
+            });
+            count++;
+            return spawn->bytes;
+        });
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            workers_[i].serializeSpawns(log, schema, count);
+        }
+    }
+
+    void serializeEdits(ReplayLog& log, const ReplaySchema& schema, uint32_t& count) {
+        edits_.Walk([&](std::byte* begin) {
+            auto edit = (EditRecord*)begin;
+            log.put(edit->entity);
+            log.put(schema.wireID(edit->index));
+            log.put(uint32_t(edit->vtable != nullptr));
+            if (edit->vtable) {
+                log.put(editPayload(edit), edit->vtable->size);
+            }
+            count++;
+            return edit->bytes;
+        });
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            workers_[i].serializeEdits(log, schema, count);
+        }
+    }
+
+    // Records what serialize wrote at `cursor` into this buffer. A spawn at
+    // a reserved entity keeps the recorded ID; the reservation itself was
+    // replayed from its own entry.
+    void deserialize(const std::byte* cursor, const ReplaySchema& schema) {
+        auto destroys = ReplayLog::take<uint32_t>(cursor);
+        for (uint32_t i = 0; i < destroys; i++) {
+            destroyEntities.push_back(ReplayLog::take<Entity>(cursor));
+        }
+        auto bulk = ReplayLog::take<uint32_t>(cursor);
+        for (uint32_t i = 0; i < bulk; i++) {
+            bool destroy = ReplayLog::take<uint32_t>(cursor) != 0;
+            auto count = ReplayLog::take<uint32_t>(cursor);
+            bulk_.push_back({ uint32_t(bulkIds_.size()), count, destroy });
+            for (uint32_t j = 0; j < count; j++) {
+                bulkIds_.push_back(schema.components_[ReplayLog::take<uint32_t>(cursor)].index);
+            }
+        }
+        auto spawns = ReplayLog::take<uint32_t>(cursor);
+        for (uint32_t i = 0; i < spawns; i++) {
+            deserializeSpawn(cursor, schema);
+        }
+        auto edits = ReplayLog::take<uint32_t>(cursor);
+        for (uint32_t i = 0; i < edits; i++) {
+            auto entity = ReplayLog::take<Entity>(cursor);
+            auto& channel = schema.components_[ReplayLog::take<uint32_t>(cursor)];
+            if (ReplayLog::take<uint32_t>(cursor) == 0) {
+                auto begin = edits_.Reserve(sizeof(EditRecord));
+                new (begin) EditRecord{ entity, channel.index, nullptr, sizeof(EditRecord) };
+                edits_.Advance(sizeof(EditRecord));
+                continue;
+            }
+            auto vtable = channel.vtable;
+            auto begin = edits_.Reserve(sizeof(EditRecord) + vtable->align - 1 + vtable->size);
+            auto payload = CommandArena::AlignUp(begin + sizeof(EditRecord), vtable->align);
+            std::memcpy(payload, cursor, vtable->size);
+            cursor += vtable->size;
+            auto bytes = size_t(payload + vtable->size - begin);
+            new (begin) EditRecord{ entity, channel.index, vtable, bytes };
+            edits_.Advance(bytes);
+        }
+    }
+
+    // Sizes the record as recordBatch does, then copies the payloads in.
+    void deserializeSpawn(const std::byte*& cursor, const ReplaySchema& schema) {
+        auto entity = ReplayLog::take<Entity>(cursor);
+        auto count = ReplayLog::take<uint32_t>(cursor);
+        auto components = ReplayLog::take<uint32_t>(cursor);
+        auto prefab = ReplayLog::take<uint32_t>(cursor);
+        assertm("the log instantiates an unknown prefab", prefab == NoPrefab || prefab < world_.prefabs_.size());
+        size_t bytes = sizeof(SpawnRecord);
+        auto scan = cursor;
+        for (uint32_t i = 0; i < components; i++) {
+            auto vtable = schema.components_[ReplayLog::take<uint32_t>(scan)].vtable;
+            bytes += alignof(ComponentRecord) - 1 + sizeof(ComponentRecord) + vtable->align - 1 + vtable->size * count;
+            scan += vtable->size * count;
+        }
+        auto begin = spawns_.Reserve(bytes);
+        auto out = begin + sizeof(SpawnRecord);
+        for (uint32_t i = 0; i < components; i++) {
+            auto& channel = schema.components_[ReplayLog::take<uint32_t>(cursor)];
+            out = CommandArena::AlignUp(out, alignof(ComponentRecord));
+            new (out) ComponentRecord{ channel.vtable, channel.index };
+            out = CommandArena::AlignUp(out + sizeof(ComponentRecord), channel.vtable->align);
+            auto size = channel.vtable->size * count;
+            std::memcpy(out, cursor, size);
+            out += size;
+            cursor += size;
+        }
+        new (begin) SpawnRecord{ entity, count, components, prefab, size_t(out - begin) };
+        spawns_.Advance(out - begin);
+    }
+
+    template <typename... ComponentTypes, typename... Args>
+    void recordSpawn(Entity entity, Args&&... components) {
+        if constexpr (sizeof...(ComponentTypes) == 0) {
+            recordSpawn<std::decay_t<Args>...>(entity, std::forward<Args>(components)...);
+        }
+        else {
+            static_assert(sizeof...(ComponentTypes) == sizeof...(Args), "one argument per component type");
+            auto arrays = recordBatch<ComponentTypes...>(entity, 1);
+            constructAt(arrays, 0, std::forward_as_tuple(std::forward<Args>(components)...), std::index_sequence_for<ComponentTypes...>{});
+        }
+    }
+
+    // Writes the record headers and returns uninitialized payload arrays.
+    template <typename... ComponentTypes>
+    std::tuple<ComponentTypes*...> recordBatch(Entity entity, size_t count, uint32_t prefab = NoPrefab) {
+        constexpr size_t headerBytes = sizeof(SpawnRecord) +
+            ((alignof(ComponentRecord) - 1 + sizeof(ComponentRecord) + alignof(ComponentTypes) - 1) + ... + 0);
+        auto begin = spawns_.Reserve(headerBytes + ((sizeof(ComponentTypes) * count) + ... + 0));
+        auto cursor = begin + sizeof(SpawnRecord);
+        std::tuple<ComponentTypes*...> arrays { writeRecord<ComponentTypes>(cursor, count)... };
+        new (begin) SpawnRecord{ entity, uint32_t(count), uint32_t(sizeof...(ComponentTypes)), prefab, size_t(cursor - begin) };
+        spawns_.Advance(cursor - begin);
+        return arrays;
+    }
+
+    template <typename T>
+    static T* writeRecord(std::byte*& cursor, size_t count) {
+        cursor = CommandArena::AlignUp(cursor, alignof(ComponentRecord));
+        new (cursor) ComponentRecord{ ComponentVTable::Of<T>(), IndexGetter<Component>::Get<T>() };
+        cursor = CommandArena::AlignUp(cursor + sizeof(ComponentRecord), alignof(T));
+        auto array = (T*)cursor;
+        cursor += sizeof(T) * count;
+        return array;
+    }
+
+    template <typename Arrays, typename Spans, size_t... Is>
+    static void copyArrays(Arrays& arrays, Spans spans, std::index_sequence<Is...>) {
+        (std::uninitialized_copy(std::get<Is>(spans).begin(), std::get<Is>(spans).end(), std::get<Is>(arrays)), ...);
+    }
+
+    // Calls `func(record, payloads)` for each component of the spawn at `begin`.
+    template <typename Func>
+    static void forEachComponent(std::byte* begin, Func&& func) {
+        auto spawn = (SpawnRecord*)begin;
+        auto cursor = begin + sizeof(SpawnRecord);
+        for (uint32_t i = 0; i < spawn->components; i++) {
+            auto record = (ComponentRecord*)CommandArena::AlignUp(cursor, alignof(ComponentRecord));
+            auto payload = CommandArena::AlignUp((std::byte*)record + sizeof(ComponentRecord), record->vtable->align);
+            func(*record, payload);
+            cursor = payload + record->vtable->size * spawn->count;
+        }
+    }
+
+    // Dedups destroys and resource removals. Destroys are sorted, so the
+    // spawn pass can cancel entities that are spawned and destroyed by the
+    // same buffer.
+    void coalesce() {
+        std::sort(destroyEntities.begin(), destroyEntities.end());
+        destroyEntities.erase(std::unique(destroyEntities.begin(), destroyEntities.end()), destroyEntities.end());
+        auto byIndex = [](const ResourceDestroyInfo& a, const ResourceDestroyInfo& b) { return a.index < b.index; };
+        auto sameIndex = [](const ResourceDestroyInfo& a, const ResourceDestroyInfo& b) { return a.index == b.index; };
+        std::sort(destroyResources_.begin(), destroyResources_.end(), byIndex);
+        destroyResources_.erase(std::unique(destroyResources_.begin(), destroyResources_.end(), sameIndex), destroyResources_.end());
+    }
+
+    // Entity IDs are handed out in recording order; the component payloads are
+    // then moved one type at a time, so each pool grows at most once.
+    void executeSpawns() {
+        collectSpawns(*this);
+        for (auto& group : spawnGroups_) {
+            if (group.total == 0) {
+                continue;
+            }
+            auto& info = world_.assureComponent(group.index, group.vtable);
+            group.first = info.pool.size;
+            info.pool.ReserveMore(group.total);
+            for (auto& run : group.runs) {
+                if (run.prototype) {
+                    group.vtable->fill(info.pool.Grow(run.count), run.prototype, run.count);
+                }
+                else {
+                    info.pool.Append(run.payload, run.count);
+                }
+                info.sparseSet.add_range(run.entity, run.count);
+            }
+        }
+        // Hooks run once every spawned entity has all its components.
+        for (auto& group : spawnGroups_) {
+            if (group.total == 0) {
+                continue;
+            }
+            world_.notifyRange(group.index, &World::ComponentHooks::onAdd, *world_.findComponent(group.index), group.first, group.total);
+            group.total = 0;
+            group.runs.clear();
+        }
+        clearSpawns();
+    }
+
+    void collectSpawns(Commands& root) {
+        auto& destroyed = root.destroyEntities;
+        spawns_.Walk([&](std::byte* begin) {
+            auto spawn = (SpawnRecord*)begin;
+            if (spawn->count == 1 && spawn->entity != NullEntity &&
+                std::binary_search(destroyed.begin(), destroyed.end(), spawn->entity)) {
+                world_.entityIds_.Release(spawn->entity);
+                destroyPayloads(begin);
+                return spawn->bytes;
+            }
+            if (spawn->entity == NullEntity) {
+                // Batches need consecutive IDs, so only single spawns reuse one.
+                spawn->entity = spawn->count == 1 ? world_.entityIds_.Acquire() : world_.entityIds_.Reserve(spawn->count);
+            }
+            world_.entities_.add_range(spawn->entity, spawn->count);
+            forEachComponent(begin, [&root, spawn](ComponentRecord& record, std::byte* payload) {
+                auto& group = root.spawnGroup(record.index, record.vtable);
+                group.total += spawn->count;
+                group.runs.push_back({ payload, nullptr, spawn->entity, spawn->count });
+            });
+            if (spawn->prefab != NoPrefab) {
+                collectPrefab(root, begin);
+            }
+            return spawn->bytes;
+        });
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            workers_[i].collectSpawns(root);
+        }
+    }
+
+    void collectPrefab(Commands& root, std::byte* begin) {
+        auto spawn = (SpawnRecord*)begin;
+        for (auto& prototype : world_.prefabs_[spawn->prefab].components) {
+            bool overridden = false;
+            forEachComponent(begin, [&](ComponentRecord& record, std::byte*) {
+                overridden |= record.index == prototype.index;
+            });
+            if (!overridden) {
+                auto& group = root.spawnGroup(prototype.index, prototype.vtable);
+                group.total += spawn->count;
+                group.runs.push_back({ nullptr, prototype.data, spawn->entity, spawn->count });
+            }
+        }
+    }
+
+    SpawnGroup& spawnGroup(ComponentID index, const ComponentVTable* vtable) {
+        if (index >= groupSlots_.size()) {
+            groupSlots_.resize(index + 1, NoGroup);
+        }
+        auto& slot = groupSlots_[index];
+        if (slot == NoGroup) {
+            slot = uint32_t(spawnGroups_.size());
+            auto& group = spawnGroups_.emplace_back();
+            group.index = index;
+            group.vtable = vtable;
+        }
+        return spawnGroups_[slot];
+    }
+
+    void clearSpawns() {
+        spawns_.Clear();
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            workers_[i].clearSpawns();
+        }
+    }
+
+    static void destroyPayloads(std::byte* begin) {
+        auto spawn = (SpawnRecord*)begin;
+        forEachComponent(begin, [spawn](ComponentRecord& record, std::byte* payload) {
+            for (uint32_t i = 0; i < spawn->count; i++) {
+                record.vtable->destroy(payload + i * record.vtable->size);
+            }
+        });
+    }
+
+    static std::byte* editPayload(EditRecord* edit) {
+        return CommandArena::AlignUp((std::byte*)edit + sizeof(EditRecord), edit->vtable->align);
+    }
+
+    // Only the last edit of each (component, entity) pair takes effect, so
+    // earlier ones are dropped before touching storage. The survivors are
+    // applied grouped by component type.
+    void executeEdits() {
+        collectEdits(pendingEdits_);
+        std::sort(pendingEdits_.begin(), pendingEdits_.end(), [](const PendingEdit& a, const PendingEdit& b) {
+            if (a.edit->index != b.edit->index) {
+                return a.edit->index < b.edit->index;
+            }
+            return a.edit->entity != b.edit->entity ? a.edit->entity < b.edit->entity : a.seq < b.seq;
+        });
+        for (size_t i = 0; i < pendingEdits_.size(); i++) {
+            auto edit = pendingEdits_[i].edit;
+            bool superseded = i + 1 < pendingEdits_.size() &&
+                pendingEdits_[i + 1].edit->index == edit->index && pendingEdits_[i + 1].edit->entity == edit->entity;
+            if (superseded) {
+                if (edit->vtable) {
+                    edit->vtable->destroy(editPayload(edit));
+                }
+            }
+            else if (edit->vtable) {
+                insertComponent(*edit, editPayload(edit));
+            }
+            else if (auto info = world_.findComponent(edit->index); info && info->sparseSet.contain(edit->entity)) {
+                world_.removeComponent(edit->index, *info, edit->entity);
+            }
+        }
+        pendingEdits_.clear();
+        clearEdits();
+    }
+
+    void collectEdits(std::vector<PendingEdit>& pending) {
+        edits_.Walk([&pending](std::byte* begin) {
+            auto edit = (EditRecord*)begin;
+            pending.push_back({ edit, pending.size() });
+            return edit->bytes;
+        });
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            workers_[i].collectEdits(pending);
+        }
+    }
+
+    void clearEdits() {
+        edits_.Clear();
+        for (size_t i = 0; i < activeWorkers_; i++) {
+            workers_[i].clearEdits();
+        }
+    }
+
+    void insertComponent(EditRecord& edit, std::byte* payload) {
+        if (!world_.entities_.contain(edit.entity)) {
+            edit.vtable->destroy(payload);
+            return;
+        }
+        auto& info = world_.assureComponent(edit.index, edit.vtable);
+        if (info.sparseSet.contain(edit.entity)) {
+            auto elem = info.Get(edit.entity);
+            edit.vtable->destroy(elem);
+            edit.vtable->relocate(elem, payload);
+            world_.notify(edit.index, &World::ComponentHooks::onReplace, edit.entity, elem);
+        }
+        else {
+            info.pool.Append(payload, 1);
+            info.sparseSet.add(edit.entity);
+            world_.notify(edit.index, &World::ComponentHooks::onAdd, edit.entity, info.pool.At(info.pool.size - 1));
+        }
+    }
+
+    void discard() {
+        edits_.Walk([](std::byte* begin) {
+            auto edit = (EditRecord*)begin;
+            if (edit->vtable) {
+                edit->vtable->destroy(editPayload(edit));
+            }
+            return edit->bytes;
+        });
+        edits_.Clear();
+        spawns_.Walk([](std::byte* begin) {
+            destroyPayloads(begin);
+            return ((SpawnRecord*)begin)->bytes;
+        });
+        spawns_.Clear();
+    }
+    
+    void destroyEntity(Entity entity) {
+        if (!world_.entities_.contain(entity)) {
+            return;
+        }
+        for (auto& [id, info] : world_.componentMap_) {
+            if (info.sparseSet.contain(entity)) {
+                world_.removeComponent(id, info, entity);
+            }
+        }
+        world_.entities_.remove(entity);
+        world_.entityIds_.Release(entity);
+    }
+
+    void executeBulk() {
+        for (auto& op : bulk_) {
+            auto ids = bulkIds_.data() + op.first;
+            if (op.destroy) {
+                destroyAll(ids, op.count);
+            }
+            else if (auto info = world_.findComponent(ids[0])) {
+                world_.clearComponent(ids[0], *info);
+            }
+        }
+    }
+
+    // Matches by walking the smallest filter set, then strips the matched
+    // entities from each storage in one pass per component type. A filter
+    // type whose whole set matched is cleared outright.
+    void destroyAll(const ComponentID* ids, uint32_t count) {
+        bulkSets_.clear();
+        EntitySet* smallest = nullptr;
+        for (uint32_t i = 0; i < count; i++) {
+            auto info = world_.findComponent(ids[i]);
+            if (!info) {
+                return;
+            }
+            bulkSets_.push_back(&info->sparseSet);
+            if (!smallest || info->sparseSet.size() < smallest->size()) {
+                smallest = &info->sparseSet;
+            }
+        }
+        bulkMatched_.clear();
+        for (auto entity : *smallest) {
+            if (std::all_of(bulkSets_.begin(), bulkSets_.end(), [entity](EntitySet* set) { return set->contain(entity); })) {
+                bulkMatched_.push_back(entity);
+            }
+        }
+        if (bulkMatched_.empty()) {
+            return;
+        }
+        for (auto& [id, info] : world_.componentMap_) {
+            if (info.sparseSet.size() == bulkMatched_.size() && std::find(ids, ids + count, id) != ids + count) {
+                world_.clearComponent(id, info);
+                continue;
+            }
+            for (auto entity : bulkMatched_) {
+                if (info.sparseSet.contain(entity)) {
+                    world_.removeComponent(id, info, entity);
+                }
+            }
+        }
+        if (bulkMatched_.size() == world_.entities_.size()) {
+            world_.entities_.reset();
+        }
+        else {
+            for (auto entity : bulkMatched_) {
+                world_.entities_.remove(entity);
+            }
+        }
+        for (auto entity : bulkMatched_) {
+            world_.entityIds_.Release(entity);
+        }
+    }
+
+    void removeResource(ResourceDestroyInfo& info) {
+        if (auto it = world_.resource_.find(info.index); it != world_.resource_.end()) {
+            info.destroy(it->second.resource);
+            it->second.resource = nullptr;
+        }
+    }
+};
+
+class Resources final {
+public:
+    Resources(World& world) : world_ { world } {}
+
+    template <typename T>
+    bool Has() {
+        auto index = IndexGetter<Resource>::Get<T>();
+        auto it = world_.resource_.find(index);
+        return (it != world_.resource_.end() && it->second.resource);
+    }
+
+    template <typename T>
+    T& Get() {
+        auto it = world_.resource_.find(IndexGetter<Resource>::Get<T>());
+        assertm("resource doesn't exist", it != world_.resource_.end() && it->second.resource);
+        return *((T*)it->second.resource);
+    }
+
+private:
+    World& world_;
+
+};
+
+class Queryer final {
+public:
+    Queryer(World& world, uint32_t slice = 0, uint32_t slices = 1) : world_ { world }, slice_ { slice }, slices_ { slices } {}
+
+    // In a staggered system this only returns the current slice of the matches.
+    template <typename... Components>
+    std::vector<Entity> Query() {
+        std::vector<Entity> entities;
+        doQuery<Components...>(entities, slice_, slices_);
+        return entities;
+    }
+
+    template <typename... Components>
+    std::vector<Entity> QueryAll() {
+        std::vector<Entity> entities;
+        doQuery<Components...>(entities, 0, 1);
+        return entities;
+    }
+
+    template <typename T>
+    bool Has(Entity entity) {
+        auto info = world_.findComponent(IndexGetter<Component>::Get<T>());
+        return info && info->sparseSet.contain(entity);
+    }
+
+    template <typename T>
+    T& Get(Entity entity) {
+        auto info = world_.findComponent(IndexGetter<Component>::Get<T>());
+        assertm("entity doesn't have this component", info && info->sparseSet.contain(entity));
+        return *((T*)info->Get(entity));
+    }
+
+
+private:
+    World& world_;
+    uint32_t slice_;
+    uint32_t slices_;
+
+    template <typename T, typename... Remains>
+    void doQuery(std::vector<Entity>& entities, uint32_t slice, uint32_t slices) {
+        auto info = world_.findComponent(IndexGetter<Component>::Get<T>());
+        if (!info) {
+            return;
+        }
+        auto size = info->sparseSet.size();
+        auto first = info->sparseSet.begin() + size * slice / slices;
+        auto last = info->sparseSet.begin() + size * (slice + 1) / slices;
+        for (auto it = first; it != last; ++it) {
+            if ((Has<Remains>(*it) && ...)) {
+                entities.push_back(*it);
+            }
+        }
+    }
+};
+
+// Records a World's inputs into a log while attached: each command buffer
+// executed outside of Startup and Update, the entity IDs reserved outside
+// of the systems, in the order they were taken, the Startup and Update
+// calls, and for each Update the published events of the schema's types and
+// the reservations and commands of its LiveOnly systems.
+// Reservations may come from any thread, but not while an Update or an
+// Execute is running. Attach it to a fresh World so that a replay starts
+// from the same state. Resources and World::Builder changes aren't
+// recorded; set them up the same way on both sides. Replay is only exact if
+// the systems are deterministic, which resumable systems, stopping on a
+// wall-clock budget, are not.
+class Recorder final {
+public:
+    friend class World;
+
+    Recorder(World& world, const ReplaySchema& schema, ReplayLog& log) : world_ { world }, schema_ { schema }, log_ { log } {
+        assertm("a World takes one recorder at a time", !world_.recorder_);
+        assertm("the log was recorded with another schema", log_.data_.empty() || log_.layout_ == schema_.layout());
+        log_.layout_ = schema_.layout();
+        world_.recorder_ = this;
+    }
+    Recorder(const Recorder&) = delete;
+    ~Recorder() {
+        world_.recorder_ = nullptr;
+    }
+
+private:
+    World& world_;
+    const ReplaySchema& schema_;
+    ReplayLog& log_;
+    // Reservations are logged from the threads that make them.
+    std::mutex mutex_;
+
+    Entity reserve(uint32_t source, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto entity = count == 0 ? world_.entityIds_.Acquire() : world_.entityIds_.Reserve(count);
+        log_.begin(ReplayLog::ReserveEntry, uint32_t(count));
+        log_.put(source);
+        log_.put(entity);
+        return entity;
+    }
+
+    void commands(Commands& commands) {
+        if (commands.idle()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto count = log_.begin(ReplayLog::CommandsEntry, 0);
+        log_.put(commands.source_);
+        auto first = log_.Bytes();
+        commands.serialize(log_, schema_);
+        log_.patch(count, uint32_t(log_.Bytes() - first));
+    }
+
+    void startup() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_.begin(ReplayLog::StartupEntry, 0);
+    }
+
+    // An Update's entries go in the order they are made: the reservations of
+    // its LiveOnly systems, the events once they are published, then the
+    // LiveOnly systems' commands as they execute. Its end closes the frame.
+    void update() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_.begin(ReplayLog::UpdateEntry, 0);
+    }
+
+    void published() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (uint32_t i = 0; i < schema_.events_.size(); i++) {
+            schema_.events_[i].capture(world_.events_, log_, i);
+        }
+    }
+
+    void updated() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_.endFrame();
+    }
+};
+
+// Feeds a log into a fresh World set up like the recorded one, as fast as
+// it can go: each step takes the frame's reservations, executes its command
+// buffers and calls Startup and Update as recorded, skipping the LiveOnly
+// systems. The events of the schema's types are published from the log, and
+// the LiveOnly systems' reservations and commands are taken from it in their
+// place.
+class Replayer final {
+public:
+    friend class World;
+
+    Replayer(World& world, const ReplaySchema& schema, const ReplayLog& log) : world_ { world }, schema_ { schema }, log_ { log }, commands_ { world } {
+        assertm("a World takes one replayer at a time", !world_.replayer_);
+        assertm("the log was recorded with another schema", log_.layout_ == schema_.layout());
+        world_.replayer_ = this;
+    }
+    Replayer(const Replayer&) = delete;
+    ~Replayer() {
+        world_.replayer_ = nullptr;
+    }
+
+    size_t Frame() const { return frame_; }
+    bool Done() const { return frame_ >= log_.Frames(); }
+
+    void Step() {
+        assertm("the log has no more frames", !Done());
+        auto frame = log_.Frame(frame_++);
+        cursor_ = frame.begin();
+        end_ = frame.end();
+        while (cursor_ != end_) {
+            auto channel = ReplayLog::take<uint32_t>(cursor_);
+            auto count = ReplayLog::take<uint32_t>(cursor_);
+            if (channel == ReplayLog::CommandsEntry || channel == ReplayLog::ReserveEntry) {
+                [[maybe_unused]] auto source = ReplayLog::take<uint32_t>(cursor_);
+                assertm("replay diverged: a LiveOnly system's entry went unused", source == Commands::External);
+            }
+            if (channel == ReplayLog::CommandsEntry) {
+                commands_.deserialize(cursor_, schema_);
+                cursor_ += count;
+                commands_.Execute();
+            }
+            else if (channel == ReplayLog::ReserveEntry) {
+                reserve(count);
+            }
+            else if (channel == ReplayLog::StartupEntry) {
+                world_.Startup();
+            }
+            else {
+                assertm("events are only recorded after an Update", channel == ReplayLog::UpdateEntry);
+                world_.Update();
+                assertm("replay diverged: a LiveOnly system's entry went unused", cursor_ == end_);
+            }
+        }
+    }
+
+    void Run() {
+        while (!Done()) {
+            Step();
+        }
+    }
+
+private:
+    World& world_;
+    const ReplaySchema& schema_;
+    const ReplayLog& log_;
+    Commands commands_;
+    size_t frame_ = 0;
+    const std::byte* cursor_ = nullptr;
+    const std::byte* end_ = nullptr;
+
+    // Takes the header of the next entry if it is of `channel` and made by
+    // `source`.
+    bool next(uint32_t channel, uint32_t source, uint32_t& count) {
+        auto at = cursor_;
+        if (at == end_ || ReplayLog::take<uint32_t>(at) != channel) {
+            return false;
+        }
+        count = ReplayLog::take<uint32_t>(at);
+        if (ReplayLog::take<uint32_t>(at) != source) {
+            return false;
+        }
+        cursor_ = at;
+        return true;
+    }
+
+    void reserve(uint32_t count) {
+        [[maybe_unused]] auto entity = ReplayLog::take<Entity>(cursor_);
+        [[maybe_unused]] auto taken = count == 0 ? world_.entityIds_.Acquire() : world_.entityIds_.Reserve(count);
+        assertm("replay diverged: a reservation got other IDs", taken == entity);
+    }
+
+    // Stand in for a skipped LiveOnly system: the IDs it reserved are taken
+    // where it would have run, and its buffer is filled before it executes.
+    void reserved(uint32_t system) {
+        uint32_t count = 0;
+        while (next(ReplayLog::ReserveEntry, system, count)) {
+            reserve(count);
+        }
+    }
+
+    void commands(uint32_t system, Commands& commands) {
+        uint32_t count = 0;
+        if (next(ReplayLog::CommandsEntry, system, count)) {
+            commands.deserialize(cursor_, schema_);
+            cursor_ += count;
+        }
+    }
+
+    // Runs once the Update's events are flushed. Entries are in channel
+    // order and empty generations have none, so a channel without an entry
+    // publishes nothing.
+    void publish() {
+        for (uint32_t i = 0; i < schema_.events_.size(); i++) {
+            auto& channel = schema_.events_[i];
+            auto next = cursor_;
+            if (next == end_ || ReplayLog::take<uint32_t>(next) != i) {
+                channel.publish(world_.events_, nullptr, 0);
+                continue;
+            }
+            auto count = ReplayLog::take<uint32_t>(next);
+            auto data = ReplayLog::alignUp(next, channel.align);
+            channel.publish(world_.events_, data, count);
+            cursor_ = data + size_t(count) * channel.size;
+        }
+    }
+};
+
+inline void World::record(Commands& commands) {
+    if (recorder_ && commands.source_ != Commands::Rerun && (commands.source_ != Commands::External || !running_)) {
+        recorder_->commands(commands);
+    }
+}
+
+inline Entity World::reserve(uint32_t source, size_t count) {
+    if (recorder_ && source != Commands::Rerun) {
+        return recorder_->reserve(source, count);
+    }
+    return count == 0 ? entityIds_.Acquire() : entityIds_.Reserve(count);
+}
+
+inline Entity World::ReserveEntity() {
+    return reserve(Commands::External, 0);
+}
+
+inline Entity World::ReserveEntities(size_t count) {
+    assertm("You must reserve at least one entity", count > 0);
+    return reserve(Commands::External, count);
+}
+
+inline void World::Startup() {
+    assertm("can't run systems while a World::Builder is alive", !building_);
+    if (recorder_) {
+        recorder_->startup();
+    }
+    running_ = true;
+    while (startupCommands_.size() < startupSystems_.size()) {
+        startupCommands_.emplace_back(*this).source_ = Commands::Rerun;
+    }
+    for (size_t i = 0; i < startupSystems_.size(); i++) {
+        startupSystems_[i](startupCommands_[i]);
+    }
+
+    for (auto& commands : startupCommands_) {
+        commands.Execute();
+    }
+    entityIds_.Recycle();
+    running_ = false;
+}
+
+inline void World::Update() {
+    assertm("can't run systems while a World::Builder is alive", !building_);
+    if (recorder_) {
+        recorder_->update();
+    }
+    running_ = true;
+    for (size_t i = 0; i < updateSystems_.size(); i++) {
+        auto& info = updateSystems_[i];
+        if ((tick_ + info.phase) % info.schedule.period != 0) {
+            continue;
+        }
+        if (replayer_ && info.schedule.liveOnly) {
+            replayer_->reserved(uint32_t(i));
+            continue;
+        }
+        auto slice = (info.runs++ + info.phase) % info.schedule.slices;
+        info.context.begin(tick_, slice, info.schedule.slices);
+        info.run(info.system, *this, updateCommands_[i], info.context);
+        info.context.end();
+    }
+    for (size_t i = 0; i < resumableSystems_.size(); i++) {
+        auto& info = resumableSystems_[i];
+        Budget budget{info.budget};
+        if (info.run(info.system, info.state, resumableCommands_[i], Queryer{*this}, Resources{*this}, events_, budget) == TaskStatus::Done) {
+            info.destroy(info.state);
+            info.state = info.create();
+        }
+    }
+    events_.flushEvents();
+    if (replayer_) {
+        replayer_->publish();
+    }
+    if (recorder_) {
+        recorder_->published();
+    }
+
+    for (size_t i = 0; i < updateCommands_.size(); i++) {
+        if (replayer_ && updateSystems_[i].schedule.liveOnly) {
+            replayer_->commands(uint32_t(i), updateCommands_[i]);
+        }
+        updateCommands_[i].Execute();
+    }
+    if (recorder_) {
+        recorder_->updated();
+    }
+    for (auto& commands : resumableCommands_) {
+        commands.Execute();
+    }
+    entityIds_.Recycle();
+    tick_++;
+    running_ = false;
+}
+
+inline auto World::CommandStats(size_t index) const {
+    return updateCommands_[index].HighWater();
+}
+
+template <typename... Components>
+class Query final {
+public:
+    static_assert(((std::is_same_v<Components, Entity> || std::is_reference_v<Components>) && ...),
+                  "query components must be Entity, T& or const T&");
+
+    using Item = std::tuple<Components...>;
+
+    // Storage of each component, resolved once per run; null for Entity.
+    using Storages = std::array<World::ComponentInfo*, sizeof...(Components)>;
+
+    class Iterator final {
+    public:
+        Iterator(std::vector<Entity>::const_iterator it, const Storages* storages) : it_ { it }, storages_ { storages } {}
+
+        Item operator*() const { return fetch(*it_, std::index_sequence_for<Components...>{}); }
+        Iterator& operator++() { ++it_; return *this; }
+        bool operator!= (const Iterator& o) const { return it_ != o.it_; }
+        bool operator== (const Iterator& o) const { return it_ == o.it_; }
+
+    private:
+        std::vector<Entity>::const_iterator it_;
+        const Storages* storages_;
+
+        template <size_t... Is>
+        Item fetch(Entity entity, std::index_sequence<Is...>) const;
+
+        template <typename T>
+        T get(World::ComponentInfo* storage, Entity entity) const;
+    };
+
+    Query(const std::vector<Entity>& entities, World& world) : entities_ { &entities }, storages_ { storage<Components>(world)... } {}
+
+    Iterator begin() { return Iterator{entities_->begin(), &storages_}; }
+    Iterator end() { return Iterator{entities_->end(), &storages_}; }
+
+    size_t Size() const { return entities_->size(); }
+    bool Empty() const { return entities_->empty(); }
+    const std::vector<Entity>& Entities() const { return *entities_; }
+
+private:
+    const std::vector<Entity>* entities_;
+    Storages storages_;
+
+    template <typename T>
+    static World::ComponentInfo* storage(World& world);
+
+};
+
+template <typename T>
+class Res final {
+public:
+    Res(const T& resource) : resource_ { &resource } {}
+
+    const T& operator*() const { return *resource_; }
+    const T* operator->() const { return resource_; }
+
+private:
+    const T* resource_;
+
+};
+
+template <typename T>
+class ResMut final {
+public:
+    ResMut(T& resource) : resource_ { &resource } {}
+
+    T& operator*() const { return *resource_; }
+    T* operator->() const { return resource_; }
+
+private:
+    T* resource_;
+
+};
+
+template <typename... Components>
+template <size_t... Is>
+inline typename Query<Components...>::Item Query<Components...>::Iterator::fetch(Entity entity, std::index_sequence<Is...>) const {
+    return Item{get<Components>((*storages_)[Is], entity)...};
+}
+
+template <typename... Components>
+template <typename T>
+inline T Query<Components...>::Iterator::get(World::ComponentInfo* storage, Entity entity) const {
+    if constexpr (std::is_same_v<T, Entity>) {
+        return entity;
+    }
+    else {
+        return *(std::remove_reference_t<T>*)storage->Get(entity);
+    }
+}
+
+template <typename... Components>
+template <typename T>
+inline World::ComponentInfo* Query<Components...>::storage(World& world) {
+    if constexpr (std::is_same_v<T, Entity>) {
+        return nullptr;
+    }
+    else {
+        return world.findComponent(IndexGetter<Component>::Get<std::remove_const_t<std::remove_reference_t<T>>>());
+    }
+}
+
+template <typename Param>
+struct SystemParam<const Param&> : SystemParam<Param> {};
+
+template <>
+struct SystemParam<Commands&> {
+    static void Declare(Access&) {}
+    static Commands& Fetch(World&, Commands& commands, SystemContext&) { return commands; }
+};
+
+template <>
+struct SystemParam<SystemContext&> {
+    static void Declare(Access&) {}
+    static SystemContext& Fetch(World&, Commands&, SystemContext& context) { return context; }
+};
+
+template <>
+struct SystemParam<Queryer> {
+    static void Declare(Access& access) { access.exclusive = true; }
+    static Queryer Fetch(World& world, Commands&, SystemContext& context) { return Queryer{world, context.slice_, context.slices_}; }
+};
+
+template <>
+struct SystemParam<Resources> {
+    static void Declare(Access& access) { access.exclusive = true; }
+    static Resources Fetch(World& world, Commands&, SystemContext&) { return Resources{world}; }
+};
+
+template <>
+struct SystemParam<Events&> {
+    static void Declare(Access& access) { access.exclusive = true; }
+    static Events& Fetch(World& world, Commands&, SystemContext&) { return world.events_; }
+};
+
+template <typename... Components>
+struct SystemParam<Query<Components...>> {
+    static void Declare(Access& access) {
+        (declare<Components>(access), ...);
+    }
+
+    static Query<Components...> Fetch(World& world, Commands&, SystemContext& context) {
+        return Query<Components...>{fetchEntities(context, filter<Components...>{}), world};
+    }
+
+private:
+    template <typename... Ts>
+    struct filter {};
+
+    template <typename T>
+    static void declare(Access& access) {
+        if constexpr (!std::is_same_v<T, Entity>) {
+            using Type = std::remove_reference_t<T>;
+            auto index = IndexGetter<Component>::Get<std::remove_const_t<Type>>();
+            (std::is_const_v<Type> ? access.reads : access.writes).push_back(index);
+        }
+    }
+
+    template <typename... Matched, typename T, typename... Remains>
+    static const std::vector<Entity>& fetchEntities(SystemContext& context, filter<Matched...>, filter<T, Remains...>) {
+        if constexpr (std::is_same_v<T, Entity>) {
+            return fetchEntities(context, filter<Matched...>{}, filter<Remains...>{});
+        }
+        else {
+            return fetchEntities(context, filter<Matched..., std::remove_const_t<std::remove_reference_t<T>>>{}, filter<Remains...>{});
+        }
+    }
+
+    template <typename... Matched>
+    static const std::vector<Entity>& fetchEntities(SystemContext& context, filter<Matched...>, filter<>) {
+        return context.Query<Matched...>();
+    }
+
+    template <typename... Ts>
+    static const std::vector<Entity>& fetchEntities(SystemContext& context, filter<Ts...> all) {
+        return fetchEntities(context, filter<>{}, all);
+    }
+};
+
+template <typename T>
+struct SystemParam<Res<T>> {
+    static void Declare(Access& access) {
+        access.resourceReads.push_back(IndexGetter<Resource>::Get<T>());
+    }
+
+    static Res<T> Fetch(World& world, Commands&, SystemContext&) {
+        Resources resources{world};
+        assertm("resource doesn't exist", resources.Has<T>());
+        return Res<T>{resources.Get<T>()};
+    }
+};
+
+template <typename T>
+struct SystemParam<ResMut<T>> {
+    static void Declare(Access& access) {
+        access.resourceWrites.push_back(IndexGetter<Resource>::Get<T>());
+    }
+
+    static ResMut<T> Fetch(World& world, Commands&, SystemContext&) {
+        Resources resources{world};
+        assertm("resource doesn't exist", resources.Has<T>());
+        return ResMut<T>{resources.Get<T>()};
+    }
+};
+
+template <typename T>
+struct SystemParam<EventReader<T>> {
+    static void Declare(Access& access) {
+        access.eventReads.push_back(IndexGetter<Event>::Get<T>());
+    }
+
+    static EventReader<T> Fetch(World& world, Commands&, SystemContext& context) {
+        auto& queue = world.events_.assureQueue<T>();
+        auto& reader = context.eventReader(IndexGetter<Event>::Get<T>());
+        if (reader == NullReader) {
+            reader = queue.AddReader();
+        }
+        return EventReader<T>(queue, reader);
+    }
+};
+
+template <typename T>
+struct SystemParam<EventWriter<T>> {
+    static void Declare(Access& access) {
+        access.eventWrites.push_back(IndexGetter<Event>::Get<T>());
+    }
+
+    static EventWriter<T> Fetch(World& world, Commands&, SystemContext&) {
+        return world.events_.Writer<T>();
+    }
+};
+
+template <typename System>
+struct SystemTraits : SystemTraits<decltype(&System::operator())> {};
+
+template <typename Ret, typename... Params>
+struct SystemTraits<Ret(*)(Params...)> {
+    using ParamList = std::tuple<Params...>;
+};
+
+template <typename Class, typename Ret, typename... Params>
+struct SystemTraits<Ret(Class::*)(Params...)> : SystemTraits<Ret(*)(Params...)> {};
+
+template <typename Class, typename Ret, typename... Params>
+struct SystemTraits<Ret(Class::*)(Params...) const> : SystemTraits<Ret(*)(Params...)> {};
+
+template <typename Type, typename... Params>
+inline void runSystem(void* system, World& world, Commands& commands, SystemContext& context, std::tuple<Params...>*) {
+    (*(Type*)system)(SystemParam<Params>::Fetch(world, commands, context)...);
+}
+
+template <typename... Params>
+inline void declareAccess(Access& access, std::tuple<Params...>*) {
+    (SystemParam<Params>::Declare(access), ...);
+}
+
+template <typename System>
+inline World& World::AddSystem(System&& system, Schedule schedule) {
+    using Type = std::decay_t<System>;
+    using ParamList = typename SystemTraits<Type>::ParamList;
+    assertm("system period and slices must be positive", schedule.period > 0 && schedule.slices > 0);
+
+    SystemInfo info{*this};
+    info.system = new Type(std::forward<System>(system));
+    info.run = [](void* system, World& world, Commands& commands, SystemContext& context) {
+        runSystem<Type>(system, world, commands, context, (ParamList*)nullptr);
+    };
+    info.destroy = [](void* elem) { delete (Type*)elem; };
+    info.schedule = schedule;
+    info.phase = leastLoadedPhase(schedule);
+    declareAccess(info.access, (ParamList*)nullptr);
+    updateSystems_.push_back(std::move(info));
+    updateCommands_.emplace_back(*this).source_ = schedule.liveOnly ? uint32_t(updateSystems_.size() - 1) : Commands::Rerun;
+    return *this;
+}
+
+inline bool SystemContext::resolve(QueryPlan& plan) {
+    for (size_t i = 0; i < plan.ids.size(); i++) {
+        if (plan.sets[i]) {
+            continue;
+        }
+        auto it = world_->componentMap_.find(plan.ids[i]);
+        if (it == world_->componentMap_.end()) {
+            return false;
+        }
+        plan.sets[i] = &it->second.sparseSet;
+    }
+    return true;
+}
+
+template <typename... Components>
+inline const std::vector<Entity>& SystemContext::Query() {
+    static_assert(sizeof...(Components) > 0, "query needs at least one component");
+    auto& plan = plans_[IndexGetter<QueryPlan>::Get<std::tuple<Components...>>()];
+    if (plan.ids.empty()) {
+        plan.ids = { IndexGetter<Component>::Get<Components>()... };
+        plan.sets.assign(plan.ids.size(), nullptr);
+    }
+    plan.entities.clear();
+    if (!resolve(plan)) {
+        return plan.entities;
+    }
+
+    auto driver = *std::min_element(plan.sets.begin(), plan.sets.end(), [](auto a, auto b) { return a->size() < b->size(); });
+    auto size = driver->size();
+    auto first = driver->begin() + size * slice_ / slices_;
+    auto last = driver->begin() + size * (slice_ + 1) / slices_;
+    for (auto it = first; it != last; ++it) {
+        auto e = *it;
+        if (std::all_of(plan.sets.begin(), plan.sets.end(), [e](auto set) { return set->contain(e); })) {
+            plan.entities.push_back(e);
+        }
+    }
+    return plan.entities;
+}
+
+// Immediate-mode access for bulk loading outside of systems. Spawns are
+// constructed straight into component storage instead of being recorded,
+// so nothing else may touch the World while a Builder is alive.
+class World::Builder final {
+public:
+    Builder(World& world) : world_ { world } {
+        assertm("only one World::Builder may be alive", !world_.building_);
+        assertm("World::Builder changes can't be recorded", !world_.recorder_);
+        world_.building_ = true;
+    }
+    Builder(const Builder&) = delete;
+    ~Builder() {
+        world_.building_ = false;
+    }
+
+    // Makes room for `count` more entities with these components.
+    template <typename... ComponentTypes>
+    Builder& Reserve(size_t count) {
+        world_.entities_.reserve(world_.entities_.size() + count);
+        (reserve<ComponentTypes>(count), ...);
+        return *this;
+    }
+
+    template <typename... ComponentTypes, typename... Args>
+    Entity Spawn(Args&&... components) {
+        if constexpr (sizeof...(ComponentTypes) == 0) {
+            return Spawn<std::decay_t<Args>...>(std::forward<Args>(components)...);
+        }
+        else {
+            static_assert(sizeof...(ComponentTypes) == sizeof...(Args), "one argument per component type");
+            auto entity = world_.entityIds_.Acquire();
+            world_.entities_.add(entity);
+            (construct<ComponentTypes>(entity, std::forward<Args>(components)), ...);
+            (added<ComponentTypes>(1), ...);
+            return entity;
+        }
+    }
+
+    // Same generator contract as Commands::SpawnBatch. Returns the first of
+    // `count` consecutive entities.
+    template <typename... ComponentTypes, typename Generator>
+    Entity SpawnBatch(size_t count, Generator&& generator) {
+        static_assert(sizeof...(ComponentTypes) > 0, "batch needs at least one component");
+        auto first = world_.entityIds_.Reserve(count);
+        world_.entities_.add_range(first, count);
+        std::tuple<ComponentTypes*...> arrays { grow<ComponentTypes>(first, count)... };
+        generate(arrays, count, generator);
+        (added<ComponentTypes>(count), ...);
+        return first;
+    }
+
+    // Same contract as Commands::Instantiate, applied immediately. Returns
+    // the first of `count` consecutive entities.
+    template <typename... Overrides, typename Generator>
+    Entity Instantiate(Prefab prefab, size_t count, Generator&& generator) {
+        auto first = instantiate<Overrides...>(prefab, count);
+        std::tuple<Overrides*...> arrays { grow<Overrides>(first, count)... };
+        generate(arrays, count, generator);
+        instantiated<Overrides...>(prefab, count);
+        return first;
+    }
+
+    Entity Instantiate(Prefab prefab, size_t count) {
+        auto first = instantiate<>(prefab, count);
+        instantiated<>(prefab, count);
+        return first;
+    }
+
+    template <typename T, typename... Args>
+    T& Emplace(Entity entity, Args&&... args) {
+        assertm("entity doesn't exist", world_.entities_.contain(entity));
+        auto& info = world_.assureComponent<T>();
+        if (info.sparseSet.contain(entity)) {
+            auto elem = (T*)info.Get(entity);
+            elem->~T();
+            new (elem) T(std::forward<Args>(args)...);
+            world_.notify(IndexGetter<Component>::Get<T>(), &ComponentHooks::onReplace, entity, elem);
+            return *elem;
+        }
+        auto& elem = construct<T>(entity, std::forward<Args>(args)...);
+        added<T>(1);
+        return elem;
+    }
+
+private:
+    World& world_;
+
+    template <typename T>
+    void reserve(size_t count) {
+        auto& info = world_.assureComponent<T>();
+        info.pool.Reserve(info.pool.size + count);
+        info.sparseSet.reserve(info.sparseSet.size() + count);
+    }
+
+    template <typename T, typename... Args>
+    T& construct(Entity entity, Args&&... args) {
+        auto& info = world_.assureComponent<T>();
+        auto elem = new (info.pool.Emplace()) T(std::forward<Args>(args)...);
+        info.sparseSet.add(entity);
+        return *elem;
+    }
+
+    // Copies every prefab component except the Overrides types, which the
+    // caller adds to each instance.
+    template <typename... Overrides>
+    Entity instantiate(Prefab prefab, size_t count) {
+        assertm("unknown prefab", prefab.index < world_.prefabs_.size());
+        auto first = world_.entityIds_.Reserve(count);
+        world_.entities_.add_range(first, count);
+        for (auto& prototype : world_.prefabs_[prefab.index].components) {
+            if (((prototype.index == IndexGetter<Component>::Get<Overrides>()) || ...)) {
+                continue;
+            }
+            auto& info = world_.assureComponent(prototype.index, prototype.vtable);
+            prototype.vtable->fill(info.pool.Grow(count), prototype.data, count);
+            info.sparseSet.add_range(first, count);
+        }
+        return first;
+    }
+
+    // Runs OnAdd for the last `count` components of type T.
+    template <typename T>
+    void added(size_t count) {
+        auto& info = world_.assureComponent<T>();
+        world_.notifyRange(IndexGetter<Component>::Get<T>(), &ComponentHooks::onAdd, info, info.pool.size - count, count);
+    }
+
+    template <typename... Overrides>
+    void instantiated(Prefab prefab, size_t count) {
+        for (auto& prototype : world_.prefabs_[prefab.index].components) {
+            if (!((prototype.index == IndexGetter<Component>::Get<Overrides>()) || ...)) {
+                auto& info = *world_.findComponent(prototype.index);
+                world_.notifyRange(prototype.index, &ComponentHooks::onAdd, info, info.pool.size - count, count);
+            }
+        }
+        (added<Overrides>(count), ...);
+    }
+
+    // Uninitialized storage for `count` components, already indexed.
+    template <typename T>
+    T* grow(Entity first, size_t count) {
+        auto& info = world_.assureComponent<T>();
+        info.sparseSet.add_range(first, count);
+        return (T*)info.pool.Grow(count);
+    }
+
+};
+
+template <typename State>
+inline World& World::AddResumableSystem(ResumableSystem<State> system, Budget::Clock::duration budget) {
+    ResumableInfo info;
+    info.system = reinterpret_cast<ResumableInfo::ErasedSystem>(system);
+    info.run = [](ResumableInfo::ErasedSystem system, void* state, Commands& commands, Queryer queryer, Resources resources, Events& events, Budget& budget) {
+        return reinterpret_cast<ResumableSystem<State>>(system)(*(State*)state, commands, queryer, resources, events, budget);
+    };
+    info.create = []()->void* { return new State(); };
+    info.destroy = [](void* elem) { delete (State*)elem; };
+    info.state = info.create();
+    info.budget = budget;
+    resumableSystems_.push_back(std::move(info));
+    resumableCommands_.emplace_back(*this).source_ = Commands::Rerun;
+    return *this;
 }
 
 template <typename T>
@@ -7,9 +7,15 @@
 #include <cassert>
 #include <limits>
 #include <type_traits>
+#include <algorithm>
 
-template <typename T, size_t PageSize, typename = std::enable_if<std::is_integral_v<T>>>
+// Values may carry tag bits outside IndexMask, such as an entity's version.
+// Slots are addressed by the masked value and contain matches the whole
+// value, so a value whose tags are out of date isn't found.
+template <typename T, size_t PageSize, T IndexMask = std::numeric_limits<T>::max()>
 class sparse_set final {
+    static_assert(std::is_integral_v<T>, "sparse_set holds integral values");
+
 public:
     void add(T t) {
         density_.push_back(t);
@@ -17,6 +23,22 @@ public:
         index(t) = density_.size() - 1;
     }
 
+    // Adds `count` consecutive values starting at `first`.
+    void add_range(T first, size_t count) {
+        if (count == 0) return;
+        auto base = density_.size();
+        if (density_.capacity() < base + count) {
+            density_.reserve(std::max(base + count, density_.capacity() * 2));
+        }
+        density_.resize(base + count);
+        assure(T(first + count - 1));
+        for (size_t i = 0; i < count; i++) {
+            T t = T(first + i);
+            density_[base + i] = t;
+            (*sparse_[page(t)])[offset(t)] = T(base + i);
+        }
+    }
+
     void remove(T t) {
         if (!contain(t)) return;
         auto& idx = index(t);
@@ -39,7 +61,18 @@ public:
         auto p = page(t);
         auto o = offset(t);
 
-        return (p < sparse_.size() && sparse_[p]->at(0) != null);
+        if (p >= sparse_.size()) return false;
+        auto i = sparse_[p]->at(o);
+        return i != null && density_[i] == t;
+    }
+
+    size_t index_of(T t) const {
+        assert(contain(t));
+        return index(t);
+    }
+
+    void reserve(size_t count) {
+        density_.reserve(count);
     }
 
     void clear() {
@@ -47,6 +80,16 @@ public:
         sparse_.clear();
     }
 
+    // Empties the set in O(size), keeping its pages for reuse.
+    void reset() {
+        for (auto t : density_) {
+            index(t) = null;
+        }
+        density_.clear();
+    }
+
+    size_t size() const { return density_.size(); }
+
     auto begin() { return density_.begin(); }
     auto end() { return density_.end(); }
 
@@ -55,15 +98,15 @@ private:
     std::vector<std::unique_ptr<std::array<T, PageSize>>> sparse_;
     static constexpr T null = std::numeric_limits<T>::max();
 
-    size_t offset(T t) const { return t % PageSize; }
-    size_t page(T t) const { return t / PageSize; } 
+    size_t offset(T t) const { return (t & IndexMask) % PageSize; }
+    size_t page(T t) const { return (t & IndexMask) / PageSize; } 
     T index(T t) const { return sparse_[page(t)]->at(offset(t)); }
     T& index(T t) { return sparse_[page(t)]->at(offset(t)); }
     void assure(T t) {
         auto p = page(t);
         if (p >= sparse_.size()) {
             for (size_t i = sparse_.size(); i <= p; i++) {
-                sparse_.emplace_back(std::make_unique<std::array<T, PageSize>>());
+                sparse_.emplace_back(new std::array<T, PageSize>);
                 sparse_[i]->fill(null);
             }
         }
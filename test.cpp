@@ -1,7 +1,60 @@
+// The checks below rely on assert, so keep it on in every build type.
+#undef NDEBUG
 #include "ecs.hpp"
 
 #include <string>
 #include <iostream>
+#include <cassert>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <thread>
+#include <atomic>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Counts heap allocations, so tests can check that a warm path makes none.
+std::atomic<size_t> allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    allocations++;
+    auto alignment = std::max(size_t(align), sizeof(void*));
+    if (auto ptr = std::aligned_alloc(alignment, (std::max(size, size_t(1)) + alignment - 1) / alignment * alignment)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
 
 struct Name {
     std::string name;
@@ -54,7 +107,806 @@ void EchoNameAndIDSystem(ecs::Commands& command, ecs::Queryer queryer, ecs::Reso
     }
 }
 
+struct Score {
+    int value;
+};
+
+// Whether `func` fails an assert. It runs in a child process, so this is
+// only checked where fork is available and assumed elsewhere.
+template <typename Func>
+bool Aborts(Func&& func) {
+#if defined(__unix__) || defined(__APPLE__)
+    auto pid = fork();
+    if (pid == 0) {
+        std::freopen("/dev/null", "w", stderr);
+        func();
+        std::_Exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+#else
+    return true;
+#endif
+}
+
+// Lanes are merged in fork order and then lane index order, whatever order
+// they were written in, and two systems may fork the same queue in a frame.
+void TestEventLanes() {
+    ecs::World world;
+    std::vector<int> seen;
+    world.AddSystem([](ecs::EventWriter<Score> writer) {
+        writer.Write(Score{ 0 });
+        writer.Fork(2);
+        writer.Worker(1).Write(Score{ 2 });
+        writer.Worker(0).Write(Score{ 1 });
+    })
+    .AddSystem([](ecs::EventWriter<Score> writer) {
+        writer.Fork(1).Worker(0).Write(Score{ 3 });
+    })
+    .AddSystem([&seen](ecs::EventReader<Score> reader) {
+        for (auto& score : reader) {
+            seen.push_back(score.value);
+        }
+    });
+
+    world.Update();
+    assert(seen.empty());
+    world.Update();
+    assert((seen == std::vector<int>{ 0, 1, 2, 3 }));
+}
+
+// A reader kept by a system that runs every third frame falls behind the
+// two readable generations; it must skip what was dropped and count it.
+void TestStoredReader() {
+    ecs::World world;
+    int frame = 0;
+    int next = -1;
+    uint64_t missed = 0;
+    std::optional<ecs::EventReader<Score>> stored;
+    world.AddSystem([&frame](ecs::EventWriter<Score> writer) {
+        writer.Write(Score{ frame });
+    })
+    .AddSystem([&](ecs::Events& events) {
+        if (!stored) {
+            stored.emplace(events.Reader<Score>());
+        }
+        if (next >= 0) {
+            next += int(stored->Missed() - missed);
+        }
+        missed = stored->Missed();
+        for (auto& score : *stored) {
+            assert(next < 0 || score.value == next);
+            next = score.value + 1;
+        }
+    }, ecs::Schedule::Every(3));
+
+    for (; frame < 12; frame++) {
+        world.Update();
+    }
+    assert(missed > 0);
+    assert(next > 0);
+}
+
+// Cached query plans must not outlive the storage Shutdown clears.
+void TestQueryAfterShutdown() {
+    ecs::World world;
+    size_t matched = 0;
+    world.AddSystem([&matched](ecs::SystemContext& context) {
+        matched = context.Query<ID>().size();
+    });
+    ecs::Commands commands(world);
+    commands.Spawn(ID{ 1 }).Execute();
+    world.Update();
+    assert(matched == 1);
+
+    world.Shutdown();
+    commands.Spawn(ID{ 2 }).Spawn(ID{ 3 }).Execute();
+    world.Update();
+    assert(matched == 2);
+}
+
+// Query items refer straight into component storage.
+void TestQueryItems() {
+    ecs::World world;
+    ecs::Commands commands(world);
+    for (int i = 0; i < 100; i++) {
+        commands.Spawn(ID{ i }, Timer{ 0 });
+    }
+    commands.Spawn(ID{ 100 }).Execute();
+    world.AddSystem([](ecs::Query<ecs::Entity, const ID&, Timer&> query) {
+        for (auto [entity, id, timer] : query) {
+            timer.time += id.id;
+        }
+    });
+    world.Update();
+    world.Update();
+
+    ecs::Queryer queryer(world);
+    auto entities = queryer.QueryAll<Timer>();
+    assert(entities.size() == 100);
+    for (auto entity : entities) {
+        assert(queryer.Get<Timer>(entity).time == 2 * queryer.Get<ID>(entity).id);
+    }
+}
+
+struct Input {
+    int dx;
+    int dy;
+};
+
+struct Position {
+    int x;
+    int y;
+};
+
+struct Health {
+    int hp;
+};
+
+struct Hit {
+    int amount;
+};
+
+// Input comes from a live-only system standing in for a device, which also
+// drops in entities; the simulation reacts to it with targeted events and
+// commands, reserving IDs after it.
+void SetUpReplayWorld(ecs::World& world, uint32_t& seed) {
+    world.RegisterPrefab(Position{ 1, 1 }, Health{ 10 });
+    world.AddStartupSystem([](ecs::Commands& commands) {
+        commands.SpawnBatch<Position, Health>(50, [](size_t i) { return std::make_tuple(Position{ int(i), 0 }, Health{ 30 }); });
+    });
+    world.AddSystem([&seed](ecs::EventWriter<Input> input, ecs::Commands& commands) {
+        seed = seed * 1664525u + 1013904223u;
+        input.Write(Input{ int(seed >> 30) - 1, int((seed >> 28) & 3) - 1 });
+        if (seed % 5 == 0) {
+            input.WriteAfter(2, Input{ 3, 3 });
+        }
+        if (seed % 3 == 0) {
+            auto dropped = commands.Spawn_r(Position{ int(seed % 7), 0 });
+            commands.Insert(dropped, Health{ 2 }).Spawn(Position{ 0, int(seed % 11) });
+        }
+    }, ecs::Schedule{}.LiveOnly())
+    .AddSystem([](ecs::Query<ecs::Entity, Position&> query, ecs::EventReader<Input> input, ecs::EventWriter<ecs::Targeted<Hit>> hits) {
+        for (auto& move : input) {
+            for (auto [entity, position] : query) {
+                position.x += move.dx;
+                position.y += move.dy;
+                if ((position.x + position.y) % 5 == 0) {
+                    hits.Write({ entity, Hit{ 1 } });
+                }
+            }
+        }
+    })
+    .AddSystem([](ecs::Query<ecs::Entity, Health&> query, ecs::EventReader<ecs::Targeted<Hit>> hits, ecs::Commands& commands) {
+        for (auto [entity, health] : query) {
+            for (auto& hit : hits.For(entity)) {
+                health.hp -= hit.event.amount;
+            }
+            if (health.hp <= 0) {
+                auto debris = commands.Spawn_r(Position{ health.hp, 0 });
+                commands.Destroy(entity).Insert(debris, ID{ health.hp });
+            }
+        }
+    });
+}
+
+void ExternalCommands(ecs::World& world, int frame) {
+    ecs::Commands commands(world);
+    if (frame % 10 == 0) {
+        commands.Spawn(Position{ frame, frame }, Health{ 20 });
+    }
+    if (frame % 15 == 0) {
+        auto entity = commands.Spawn_r(Position{ -frame, 0 });
+        commands.Insert(entity, ID{ frame });
+    }
+    if (frame % 20 == 0) {
+        commands.Instantiate(ecs::Prefab{ 0 }, 3);
+    }
+    if (frame % 30 == 0) {
+        commands.Remove<ID>(ecs::Entity(frame % 50));
+        commands.Destroy(ecs::Entity(frame % 40));
+    }
+    if (frame == 90) {
+        commands.DestroyAll<ID>();
+    }
+    if (frame % 25 == 5) {
+        // Reserved ahead, while recycled IDs are waiting; the first of the
+        // pair is never spawned.
+        auto pair = world.ReserveEntities(2);
+        auto single = world.ReserveEntity();
+        commands.SpawnAt(pair + 1, Position{ frame, -frame })
+                .SpawnAt(single, Position{ -frame, frame }, Health{ 5 });
+    }
+    if (frame % 25 == 12) {
+        // Executed in the opposite order to the reservations.
+        ecs::Commands other(world);
+        auto first = commands.Spawn_r(Position{ 1, frame });
+        auto second = other.Spawn_r(Position{ 2, frame });
+        other.Insert(second, ID{ frame }).Execute();
+        commands.Insert(first, ID{ -frame });
+    }
+    commands.Execute();
+}
+
+uint64_t HashWorld(ecs::World& world) {
+    ecs::Queryer queryer(world);
+    uint64_t hash = 1469598103934665603ull;
+    auto mix = [&hash](uint64_t value) { hash = (hash ^ value) * 1099511628211ull; };
+    auto entities = queryer.QueryAll<Position>();
+    std::sort(entities.begin(), entities.end());
+    for (auto entity : entities) {
+        auto& position = queryer.Get<Position>(entity);
+        mix(entity);
+        mix(uint64_t(position.x));
+        mix(uint64_t(position.y));
+        mix(queryer.Has<Health>(entity) ? uint64_t(queryer.Get<Health>(entity).hp) : 0);
+        mix(queryer.Has<ID>(entity) ? uint64_t(queryer.Get<ID>(entity).id) : 0);
+    }
+    return hash;
+}
+
+// A recorded run replayed from a saved log into a fresh World ends in the
+// same state, without running the live-only input system: its events,
+// commands and reserved IDs come from the log. Broken logs are rejected on
+// load.
+void TestReplay() {
+    ecs::ReplaySchema schema;
+    schema.Event<Input>().Component<Position>().Component<Health>().Component<ID>();
+    ecs::ReplayLog log;
+    uint32_t seed = 1;
+    uint64_t live = 0;
+    {
+        ecs::World world;
+        SetUpReplayWorld(world, seed);
+        ecs::Recorder recorder(world, schema, log);
+        world.Startup();
+        for (int frame = 0; frame < 120; frame++) {
+            ExternalCommands(world, frame);
+            world.Update();
+        }
+        live = HashWorld(world);
+    }
+    assert(log.Frames() == 120);
+
+    std::stringstream file;
+    log.Save(file);
+    auto bytes = file.str();
+    ecs::ReplayLog loaded;
+    assert(loaded.Load(file));
+
+    uint32_t unused = 1;
+    ecs::World world;
+    SetUpReplayWorld(world, unused);
+    ecs::Replayer replayer(world, schema, loaded);
+    replayer.Run();
+    assert(unused == 1);
+    assert(replayer.Frame() == 120);
+    assert(HashWorld(world) == live);
+
+    std::stringstream truncated(bytes.substr(0, bytes.size() - 5));
+    assert(!loaded.Load(truncated));
+    assert(loaded.Frames() == 0);
+
+    // Layout: magic, then the layout, frame index and data vectors, each
+    // prefixed by its size. Break the first entry's count.
+    size_t data = 4 + 8 + 4 * 7 + 8 + 8 * 120 + 8;
+    auto corrupt = bytes;
+    corrupt[data + 4] = char(0xff);
+    corrupt[data + 5] = char(0xff);
+    std::stringstream garbled(corrupt);
+    assert(!loaded.Load(garbled));
+}
+
+// Destroying an entity spawned by the same buffer cancels the spawn, and
+// only the last edit to a (component, entity) pair takes effect.
+void TestCommandCoalescing() {
+    ecs::World world;
+    ecs::Queryer queryer(world);
+    int added = 0;
+    world.OnAdd<ID>([&added](ecs::Entity, ID&) { added++; });
+
+    ecs::Commands commands(world);
+    auto kept = commands.Spawn_r(ID{ 1 });
+    auto canceled = commands.Spawn_r(ID{ 2 });
+    commands.Destroy(canceled).Execute();
+    assert(queryer.QueryAll<ID>().size() == 1);
+    assert(queryer.Get<ID>(kept).id == 1);
+    assert(added == 1);
+
+    commands.Insert(kept, Timer{ 1 })
+            .Insert(kept, Timer{ 2 })
+            .Remove<Timer>(kept)
+            .Insert(kept, Timer{ 3 })
+            .Insert(kept, ID{ 4 })
+            .Remove<ID>(kept)
+            .Execute();
+    assert(queryer.Get<Timer>(kept).time == 3);
+    assert(!queryer.Has<ID>(kept));
+}
+
+// A delayed event is published at the flush `ticks` frames after the one
+// that would publish it undelayed, whichever wheel level holds it.
+void TestDelayedEvents() {
+    const std::vector<uint64_t> delays = { 0, 1, 2, 63, 64, 65, 4095, 4096, 5000 };
+    ecs::World world;
+    std::vector<std::pair<int, uint64_t>> arrivals;
+    world.AddSystem([&delays](ecs::EventWriter<Score> writer, ecs::SystemContext& context) {
+        if (context.FirstRun()) {
+            for (size_t i = 0; i < delays.size(); i++) {
+                writer.WriteAfter(delays[i], Score{ int(i) });
+            }
+        }
+    })
+    .AddSystem([&arrivals, &world](ecs::EventReader<Score> reader) {
+        for (auto& score : reader) {
+            arrivals.emplace_back(score.value, world.Tick());
+        }
+    });
+    for (int frame = 0; frame < 5010; frame++) {
+        world.Update();
+    }
+
+    assert(arrivals.size() == delays.size());
+    for (auto [index, tick] : arrivals) {
+        assert(tick == delays[index] + 1);
+    }
+}
+
+struct Due {
+    uint64_t tick;
+};
+
+// 500k events with random delays, written over the first 10k of 40k
+// frames, each arrive on exactly the frame they are due.
+void TestRandomDelays() {
+    ecs::World world;
+    uint32_t seed = 7;
+    size_t arrived = 0;
+    world.AddSystem([&seed](ecs::EventWriter<Due> writer, ecs::SystemContext& context) {
+        if (context.ThisRun() >= 10000) {
+            return;
+        }
+        for (int i = 0; i < 50; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            auto delay = (seed >> 8) % 30000;
+            writer.WriteAfter(delay, Due{ context.ThisRun() + delay + 1 });
+        }
+    })
+    .AddSystem([&arrived](ecs::EventReader<Due> reader, ecs::SystemContext& context) {
+        for (auto& due : reader) {
+            assert(due.tick == context.ThisRun());
+            arrived++;
+        }
+    });
+    for (int frame = 0; frame < 40000; frame++) {
+        world.Update();
+    }
+    assert(arrived == 500000);
+}
+
+// Entries past the top wheel level wait in overflow and still fire on
+// their tick, in scheduling order.
+void TestTimerWheelOverflow() {
+    ecs::TimerWheel<int> wheel(0);
+    const std::vector<uint64_t> dues = { 1u << 24, 3, (1u << 24) + 5, 1u << 18, (1u << 24) + 5, 20000000 };
+    for (size_t i = 0; i < dues.size(); i++) {
+        wheel.Schedule(dues[i], int(i));
+    }
+    std::vector<int> fired;
+    for (uint64_t tick = 0; tick <= 20000000; tick++) {
+        wheel.Advance([&](int index) {
+            assert(dues[index] == tick);
+            fired.push_back(index);
+        });
+    }
+    assert((fired == std::vector<int>{ 1, 3, 0, 2, 4, 5 }));
+}
+
+// Worker buffers get their IDs at Execute in worker index order, whatever
+// order they were recorded in.
+void TestWorkerSpawnOrder() {
+    ecs::World world;
+    ecs::Queryer queryer(world);
+    ecs::Commands commands(world);
+    commands.Spawn(ID{ 0 }).Fork(3);
+    commands.Worker(2).Spawn(ID{ 3 });
+    commands.Worker(0).Spawn(ID{ 1 });
+    commands.Worker(1).Spawn(ID{ 2 });
+    commands.Execute();
+
+    auto entities = queryer.QueryAll<ID>();
+    std::sort(entities.begin(), entities.end());
+    assert(entities.size() == 4);
+    for (size_t i = 0; i < entities.size(); i++) {
+        assert(queryer.Get<ID>(entities[i]).id == int(i));
+    }
+}
+
+// OnRemove fires for every component an entity loses, whether it goes
+// through Destroy, DestroyAll or RemoveAll.
+void TestRemoveHooks() {
+    ecs::World world;
+    int added = 0, removedHealth = 0, removedPosition = 0, hp = 0;
+    world.OnAdd<Health>([&](ecs::Entity, Health&) { added++; })
+        .OnRemove<Health>([&](ecs::Entity, Health& health) { removedHealth++; hp += health.hp; })
+        .OnRemove<Position>([&](ecs::Entity, Position&) { removedPosition++; });
+
+    ecs::Commands commands(world);
+    std::vector<ecs::Entity> moving;
+    for (int i = 0; i < 3; i++) {
+        moving.push_back(commands.Spawn_r(Position{ i, i }, Health{ 1 }));
+    }
+    commands.Spawn(Health{ 10 }).Spawn(Health{ 10 });
+    commands.Execute();
+    assert(added == 5);
+
+    commands.Destroy(moving[0]).Execute();
+    assert(removedHealth == 1 && removedPosition == 1 && hp == 1);
+
+    commands.DestroyAll<Position>().Execute();
+    assert(removedHealth == 3 && removedPosition == 3 && hp == 3);
+
+    commands.RemoveAll<Health>().Execute();
+    assert(removedHealth == 5 && removedPosition == 3 && hp == 23);
+
+    ecs::Queryer queryer(world);
+    assert(queryer.QueryAll<Health>().empty());
+    assert(added == 5);
+}
+
+struct Walk {
+    size_t next;
+};
+
+std::vector<size_t> walked;
+
+// Takes one step per frame and is done after three.
+ecs::TaskStatus WalkSystem(Walk& walk, ecs::Commands&, ecs::Queryer, ecs::Resources, ecs::Events&, ecs::Budget&) {
+    walked.push_back(walk.next);
+    return ++walk.next == 3 ? ecs::TaskStatus::Done : ecs::TaskStatus::Yield;
+}
+
+// A resumable system's state starts value-initialized, is kept across the
+// frames it yields, and starts over once it is done.
+void TestResumableSystem() {
+    ecs::World world;
+    world.AddResumableSystem<Walk>(WalkSystem, std::chrono::milliseconds(1));
+    for (int frame = 0; frame < 7; frame++) {
+        world.Update();
+    }
+    assert((walked == std::vector<size_t>{ 0, 1, 2, 0, 1, 2, 0 }));
+}
+
+// Once the buffers have grown, applying inserts and removes allocates nothing.
+void TestEditsDontAllocate() {
+    ecs::World world;
+    ecs::Commands commands(world);
+    std::vector<ecs::Entity> entities;
+    for (int i = 0; i < 64; i++) {
+        entities.push_back(commands.Spawn_r(ID{ i }));
+    }
+    commands.Execute();
+
+    auto frame = [&](int i) {
+        for (auto entity : entities) {
+            commands.Insert(entity, Timer{ i }).Insert(entity, ID{ i }).Remove<Timer>(entity).Insert(entity, Timer{ i });
+        }
+        commands.Execute();
+    };
+    for (int i = 0; i < 4; i++) {
+        frame(i);
+    }
+    size_t before = allocations;
+    for (int i = 0; i < 100; i++) {
+        frame(i);
+    }
+    assert(allocations == before);
+}
+
+// Move-only, and without a default constructor.
+struct Mesh {
+    std::unique_ptr<int> vertices;
+
+    explicit Mesh(int count) : vertices { std::make_unique<int>(count) } {}
+};
+
+// Components and resources that can only be moved go through every path
+// that stores them, including pool growth and replacement.
+void TestMoveOnlyComponents() {
+    ecs::World world;
+    ecs::Queryer queryer(world);
+    ecs::Resources resources(world);
+    ecs::Commands commands(world);
+    for (int i = 0; i < 100; i++) {
+        commands.Spawn(Mesh{ i }, ID{ i });
+    }
+    auto reserved = commands.Spawn_r(Mesh{ 1000 });
+    auto emplaced = commands.Spawn_r(ID{ -1 });
+    commands.Emplace<Mesh>(emplaced, 2000)
+            .Insert(reserved, Mesh{ 1001 })
+            .SetResource(Mesh{ 3000 })
+            .Execute();
+
+    for (auto entity : queryer.QueryAll<Mesh, ID>()) {
+        auto id = queryer.Get<ID>(entity).id;
+        assert(*queryer.Get<Mesh>(entity).vertices == (id < 0 ? 2000 : id));
+    }
+    assert(queryer.QueryAll<Mesh>().size() == 102);
+    assert(*queryer.Get<Mesh>(reserved).vertices == 1001);
+    assert(*resources.Get<Mesh>().vertices == 3000);
+
+    commands.EmplaceResource<Mesh>(3001).Remove<Mesh>(reserved).Execute();
+    assert(*resources.Get<Mesh>().vertices == 3001);
+    assert(!queryer.Has<Mesh>(reserved));
+}
+
+// A Builder constructs straight into storage and runs the hooks as it
+// goes. Systems can't run while it is alive.
+void TestBuilder() {
+    ecs::World world;
+    ecs::Queryer queryer(world);
+    int added = 0, replaced = 0;
+    world.OnAdd<Position>([&added](ecs::Entity, Position&) { added++; })
+         .OnReplace<Position>([&replaced](ecs::Entity, Position& position) {
+             assert(position.x == 50);
+             replaced++;
+         });
+    world.AddSystem([](ecs::Query<Health&> query) {
+        for (auto [health] : query) {
+            health.hp++;
+        }
+    });
+
+    ecs::Entity first = 0, single = 0;
+    {
+        ecs::World::Builder builder(world);
+        builder.Reserve<Position, Health>(1000);
+        first = builder.SpawnBatch<Position, Health>(1000, [](size_t i) {
+            return std::make_tuple(Position{ int(i), 0 }, Health{ int(i) });
+        });
+        assert(added == 1000);
+
+        builder.Emplace<Position>(first + 5, Position{ 50, 50 });
+        assert(added == 1000 && replaced == 1);
+        single = builder.Spawn(Health{ -1 });
+        builder.Emplace<Position>(single, Position{ 1, 2 });
+        assert(added == 1001);
+
+        assert(Aborts([&world] { world.Update(); }));
+    }
+    world.Update();
+
+    assert((queryer.QueryAll<Position, Health>().size() == 1001));
+    assert(queryer.Get<Position>(first + 5).x == 50);
+    assert(queryer.Get<Position>(first + 999).x == 999);
+    assert(queryer.Get<Health>(first + 999).hp == 1000);
+    assert(queryer.Get<Position>(single).y == 2);
+    assert(queryer.Get<Health>(single).hp == 0);
+}
+
+// A system staggered over N slices sees each matched entity exactly once
+// in N runs, and systems sharing a period run on different frames.
+void TestSchedules() {
+    ecs::World world;
+    ecs::Commands commands(world);
+    commands.SpawnBatch<ID>(100, [](size_t i) { return ID{ int(i) }; }).Execute();
+
+    std::vector<int> seen(100, 0);
+    std::vector<size_t> perRun;
+    std::vector<uint64_t> evenFrames, oddFrames;
+    world.AddSystem([&](ecs::Query<const ID&> query) {
+        perRun.push_back(query.Size());
+        for (auto [id] : query) {
+            seen[id.id]++;
+        }
+    }, ecs::Schedule::Staggered(3))
+    .AddSystem([&](ecs::SystemContext& context) { evenFrames.push_back(context.ThisRun()); }, ecs::Schedule::Every(2))
+    .AddSystem([&](ecs::SystemContext& context) { oddFrames.push_back(context.ThisRun()); }, ecs::Schedule::Every(2));
+
+    for (int frame = 0; frame < 3; frame++) {
+        world.Update();
+    }
+    assert(std::all_of(seen.begin(), seen.end(), [](int count) { return count == 1; }));
+    assert((perRun == std::vector<size_t>{ 33, 33, 34 }));
+
+    for (int frame = 3; frame < 8; frame++) {
+        world.Update();
+    }
+    assert(evenFrames.size() == 4 && oddFrames.size() == 4);
+    for (size_t i = 0; i < 4; i++) {
+        assert(evenFrames[i] % 2 != oddFrames[i] % 2);
+        assert(i == 0 || evenFrames[i] == evenFrames[i - 1] + 2);
+    }
+}
+
+// Each World has its own queues: events written in one are never seen by
+// the readers of another.
+void TestWorldEventsIsolated() {
+    ecs::World first, second;
+    int firstSeen = 0, secondSeen = 0;
+    first.AddSystem([](ecs::EventWriter<Score> writer) { writer.Write(Score{ 1 }); })
+         .AddSystem([&firstSeen](ecs::EventReader<Score> reader) {
+             for (auto& score : reader) {
+                 firstSeen += score.value;
+             }
+         });
+    second.AddSystem([&secondSeen](ecs::EventReader<Score> reader, ecs::Events& events) {
+        secondSeen += int(reader.Lag() + events.Reader<Score>().Lag());
+    });
+
+    for (int frame = 0; frame < 3; frame++) {
+        first.Update();
+        second.Update();
+    }
+    assert(firstSeen == 2);
+    assert(secondSeen == 0);
+}
+
+// ReadAll hands out one generation at a time as a contiguous span, so a
+// reader that runs every other frame gets the older generation first and
+// the newer one from a second call.
+void TestReadAll() {
+    ecs::World world;
+    std::vector<std::vector<int>> spans;
+    world.AddSystem([](ecs::EventWriter<Score> writer, ecs::SystemContext& context) {
+        for (int i = 0; i < 3; i++) {
+            writer.Write(Score{ int(context.ThisRun()) * 10 + i });
+        }
+    })
+    .AddSystem([&spans](ecs::EventReader<Score> reader) {
+        for (auto events = reader.ReadAll(); !events.empty(); events = reader.ReadAll()) {
+            for (size_t i = 1; i < events.size(); i++) {
+                assert(&events[i] == &events[0] + i);
+            }
+            spans.emplace_back();
+            for (auto& score : events) {
+                spans.back().push_back(score.value);
+            }
+        }
+        assert(!reader.Has());
+    }, ecs::Schedule::Every(2));
+
+    for (int frame = 0; frame < 5; frame++) {
+        world.Update();
+    }
+    assert((spans == std::vector<std::vector<int>>{ { 0, 1, 2 }, { 10, 11, 12 }, { 20, 21, 22 }, { 30, 31, 32 } }));
+}
+
+// Once the queues have grown, writing, publishing and reading 5000 events
+// of two types per frame allocates nothing.
+void TestEventsDontAllocate() {
+    ecs::World world;
+    uint64_t sum = 0;
+    world.AddSystem([](ecs::EventWriter<Score> scores, ecs::EventWriter<Hit> hits) {
+        for (int i = 0; i < 5000; i++) {
+            scores.Write(Score{ i });
+            hits.Emplace(Hit{ 1 });
+        }
+    })
+    .AddSystem([&sum](ecs::EventReader<Score> scores, ecs::EventReader<Hit> hits) {
+        for (auto& score : scores) {
+            sum += score.value;
+        }
+        for (auto& hit : hits.ReadAll()) {
+            sum += hit.amount;
+        }
+    });
+
+    for (int frame = 0; frame < 4; frame++) {
+        world.Update();
+    }
+    size_t before = allocations;
+    sum = 0;
+    for (int frame = 0; frame < 100; frame++) {
+        world.Update();
+    }
+    assert(allocations == before);
+    assert(sum == 100 * (4999 * 5000 / 2 + 5000));
+}
+
+// Worker lanes written from real threads merge into a complete stream in
+// lane order. Build with -fsanitize=thread to check the lanes for races.
+void TestThreadedLanes() {
+    constexpr int Threads = 8;
+    constexpr int PerThread = 20000;
+    ecs::World world;
+    std::vector<int> seen;
+    world.AddSystem([](ecs::EventWriter<Score> writer) {
+        writer.Fork(Threads);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < Threads; t++) {
+            threads.emplace_back([lane = writer.Worker(t), t]() mutable {
+                for (int i = 0; i < PerThread; i++) {
+                    lane.Write(Score{ t * PerThread + i });
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }, ecs::Schedule::Every(2))
+    .AddSystem([&seen](ecs::EventReader<Score> reader) {
+        for (auto& score : reader) {
+            seen.push_back(score.value);
+        }
+    });
+
+    world.Update();
+    world.Update();
+    assert(seen.size() == size_t(Threads * PerThread));
+    for (size_t i = 0; i < seen.size(); i++) {
+        assert(seen[i] == int(i));
+    }
+}
+
+// Once a destroyed entity's slot is reused, its old handle reaches nothing:
+// commands and lookups through it are no-ops, and it gets none of the
+// targeted events of the new entity.
+void TestStaleHandles() {
+    ecs::World world;
+    ecs::Queryer queryer(world);
+    ecs::Commands commands(world);
+    auto stale = commands.Spawn_r(ID{ 1 });
+    commands.Execute();
+    commands.Destroy(stale).Execute();
+    world.Update();
+    auto reused = commands.Spawn_r(ID{ 2 });
+    commands.Execute();
+    assert(ecs::EntityIndex(reused) == ecs::EntityIndex(stale));
+    assert(ecs::EntityVersion(reused) == ecs::EntityVersion(stale) + 1);
+    assert(!queryer.Has<ID>(stale) && queryer.Has<ID>(reused));
+
+    commands.Insert(stale, Timer{ 1 }).Remove<ID>(stale).Destroy(stale).Execute();
+    assert(queryer.Get<ID>(reused).id == 2);
+    assert(!queryer.Has<Timer>(reused));
+
+    ecs::EventQueue<ecs::Targeted<Hit>> hits(0);
+    hits.Back().push_back({ reused, Hit{ 1 } });
+    hits.Flush();
+    assert(hits.For(reused).size() == 1);
+    assert(hits.For(stale).empty());
+
+    // Hits for both versions of the slot, as a delayed event to the old
+    // entity would give, keep apart.
+    for (int i = 0; i < 6; i++) {
+        hits.Back().push_back({ i % 2 ? stale : reused, Hit{ i } });
+    }
+    hits.Back().push_back({ stale + 1, Hit{ 6 } });
+    hits.Flush();
+    auto current = hits.For(reused);
+    auto old = hits.For(stale);
+    assert(current.size() == 3 && old.size() == 3);
+    for (int i = 0; i < 3; i++) {
+        assert(current[i].target == reused && current[i].event.amount == 2 * i);
+        assert(old[i].target == stale && old[i].event.amount == 2 * i + 1);
+    }
+    assert(hits.For(stale + 1).size() == 1);
+}
+
 int main() {
+    TestEventLanes();
+    TestStoredReader();
+    TestQueryAfterShutdown();
+    TestQueryItems();
+    TestReplay();
+    TestCommandCoalescing();
+    TestDelayedEvents();
+    TestRandomDelays();
+    TestTimerWheelOverflow();
+    TestWorkerSpawnOrder();
+    TestRemoveHooks();
+    TestResumableSystem();
+    TestEditsDontAllocate();
+    TestMoveOnlyComponents();
+    TestBuilder();
+    TestSchedules();
+    TestWorldEventsIsolated();
+    TestReadAll();
+    TestEventsDontAllocate();
+    TestThreadedLanes();
+    TestStaleHandles();
+
     ecs::World world;
     world.AddStartupSystem(StartUpSystem)
     .SetResources<Timer>(Timer{ 2002 })